@@ -54,11 +54,12 @@ def dis(insn, match):
 
 TIMEPRE_S = memalias.TIMEPRE_S
 INSN_S = r' (?P<addr>.*): (?P<insn>.*)\((?P<desc>.*)\) '
+MOD_S = r'(?P<module>( \[.*\])?)$'
 re_debug = re.compile(
-    TIMEPRE_S + 'debug' + INSN_S + r'(?P<Rd>.*) (?P<Rn>.*)$')
+    TIMEPRE_S + 'debug' + INSN_S + r'(?P<Rd>\S+) (?P<Rn>\S+)' + MOD_S)
 re_trace = re.compile(
     TIMEPRE_S + 'mmutrace' + INSN_S
-    + r'(?P<vaddr>.*) (?P<val>.*) \((?P<changed>.*)\)$')
+    + r'(?P<vaddr>\S+) (?P<val>\S+) \((?P<changed>[^)]*)\)' + MOD_S)
 re_irq = re.compile(
     TIMEPRE_S + r'(?P<data>(break |irq |cpu resumed|WinCE resume).*)$')
 getClock = memalias.getClock
@@ -79,8 +80,8 @@ def procline(line):
             regs = Rdval
         else:
             regs = Rdval + " " + Rnval
-        print "%s %s: %-21s # %s" % (
-            getClock(m), m.group('addr'), iname, regs)
+        print "%s %s: %-21s # %s%s" % (
+            getClock(m), m.group('addr'), iname, regs, m.group('module'))
         return
 
     m = re_trace.match(line)
@@ -101,9 +102,9 @@ def procline(line):
         paddr, reginfo = memalias.lookupVirt(vaddr)
         if reginfo is not None:
             addrname = "%8s" % reginfo[0]
-        print "%s %s: %-21s # %s%s%s%s" % (
+        print "%s %s: %-21s # %s%s%s%s%s" % (
             getClock(m), m.group('addr'), iname
-            , addrname, op, m.group('val'), changed)
+            , addrname, op, m.group('val'), changed, m.group('module'))
         return
 
     m = re_irq.match(line)
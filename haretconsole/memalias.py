@@ -184,7 +184,8 @@ re_mmu = re.compile(
     r" (?P<newvaddr>.*) \(tbl (?P<tbldev>.*)\)$")
 re_mem = re.compile(
     TIMEPRE_S + r"(?P<type>insn|mem) (?P<var>.*)\((?P<varpos>\d+)\)"
-    r" (?P<vaddr>.*)=(?P<val>.*) \((?P<changed>.*)\)(?P<pc>( @~.*)?)$")
+    r" (?P<vaddr>.*)=(?P<val>.*) \((?P<changed>.*)\)(?P<pc>( @~[^<]*)?)"
+    r"(?P<regname>( <.*>)?)$")
 
 # Storage of known named registers that are being "watched"
 # VirtMap[vaddr] = (paddr, (name, ((bits, name), (bits,name), ...)))
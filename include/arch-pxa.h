@@ -7,10 +7,10 @@ public:
     int detect();
     void init();
     virtual int preHardwareShutdown();
-    virtual void hardwareShutdown(struct fbinfo *fbi);
+    virtual uint32 readClock();
 
     uint32 dcsr_count;
-    uint32 *dma, *udc;
+    uint32 *dma, *udc, *oscr;
 };
 
 // PXA 27x
@@ -20,9 +20,9 @@ public:
     int detect();
     void init();
     virtual int preHardwareShutdown();
-    virtual void hardwareShutdown(struct fbinfo *fbi);
 
     uint32 *cken, *uhccoms;
 };
 
 int testPXA();
+int testPXA27x();
@@ -16,6 +16,10 @@
 #define PAGE_ALIGNED __attribute__ ((aligned (4096)))
 // Return an integer rounded up to the nearest page
 #define PAGE_ALIGN(v) (((v)+PAGE_SIZE-1) / PAGE_SIZE * PAGE_SIZE)
+// Size of a data cache line (PXA, sa1100, and arm920t all use 32)
+#define DCACHE_LINE 32
+// Set a variable to be aligned on a data cache line.
+#define CACHE_ALIGNED __attribute__ ((aligned (DCACHE_LINE)))
 
 // Macros useful for defining CPU coprocessor accessor functions
 #define DEF_GETCPRATTR(Name, Cpr, Op1, CRn, CRm, Op2, Attr, Clob)       \
@@ -73,6 +77,8 @@ static inline uint32 rotl(uint32 val, uint32 shift) {
 }
 
 void printWelcome();
+void lockAppPages();
+void unlockAppPages();
 void take_control();
 void return_control();
 
@@ -56,53 +56,82 @@ struct pollinfo {
 // Persistent data accessible by both exception handlers and regular
 // code.
 struct irqData {
-    // Summary counters.
-    uint32 irqCount, abortCount, prefetchCount;
+    //
+    // Hot header - fields read on every exception.  These are kept
+    // together in the first few cache lines so that a traced
+    // exception only adds a couple of lines to the cache footprint
+    // (see IRQLINES).  Larger and rarely used storage follows.
+    //
+
+    // Summary counters.  These must stay at the start of the struct -
+    // the counting only handlers in irqchain.S update them directly.
+    uint32 irqCount CACHE_ALIGNED, abortCount, prefetchCount;
+    // Cycles spent in the C irq handler (PXA only).
+    uint32 irqCycleCount;
+    uint64 irqCycles;
+    uint32 clock;
+    uint32 dbcon;
+
+    // Fixed rate sampling timer (see WIRQRATE).
+    volatile uint32 *ostRegs, *intcRegs;
+    uint32 sampleChannel, sampleInterval;
+    uint32 sampleCount, sampleLate;
+
+    // MMU L1 table merging (see mmumerge.cpp)
+    uint32 mergeTableCount;
+    uint32 mergeTableStart;
 
-    // Standard memory polling.
-    struct pollinfo tracepoll;
-    struct pollinfo irqpoll;
-    struct pollinfo resumepoll;
+    // Trace buffer positions.
+    uint32 writePos, readPos;
+    uint32 overflows, errors;
+
+    uint32 *mmuVAddr;
+    // Intel PXA based chip?
+    int isPXA;
+    uint32 alterCount;
+    uint32 traceForWatch;
+    uint32 ignoreAddrCount;
+    uint32 exitEarly;
+    // Also check ICIP2 for pending irqs (PXA27x, see WIRQRATE).
+    uint32 sampleICIP2;
+
+    //
+    // Standard memory polling.  Each list starts on its own cache
+    // line so the count and first entries share a line.
+    //
+    struct pollinfo irqpoll CACHE_ALIGNED;
+    struct pollinfo tracepoll CACHE_ALIGNED;
+    struct pollinfo resumepoll CACHE_ALIGNED;
 
     //
     // MMU tracing specific
     //
-    uint32 *mmuVAddr;
     uint32 redirectVAddrBase;
-    uint32 alterCount, alterVAddrs[MAX_L1TRACE];
+    uint32 alterVAddrs[MAX_L1TRACE];
     uint32 traceCount;
     memcheck traceAddrs[MAX_L1TRACE];
     uint32 max_l1trace, max_l1trace_after_resume;
 
     uint32 ignoreAddr[MAX_IGNOREADDR];
-    uint32 ignoreAddrCount;
 
     //
     // PXA tracing specific
     //
 
-    // Intel PXA based chip?
-    int isPXA;
-
     // Instruction trace information.
     struct insn_s { uint32 addr1, addr2, reg1, reg2; } insns[2];
-    uint32 dbr0, dbr1, dbcon;
-    uint32 traceForWatch;
+    uint32 dbr0, dbr1;
+    // Original ICLR bit of the sampling timer irq.
+    uint32 sampleICLR;
 
     //
     // Trace buffer.
     //
-    uint32 overflows, errors;
-    uint32 writePos, readPos;
-    uint32 clock;
-    uint32 exitEarly;
-    struct traceitem traces[NR_TRACE];
+    struct traceitem traces[NR_TRACE] CACHE_ALIGNED;
 
     //
-    // MMU L1 table merging (see mmumerge.cpp)
+    // MMU L1 table merging copies (see mmumerge.cpp)
     //
-    uint32 mergeTableCount;
-    uint32 mergeTableStart;
     uint32 l1Copy[4096];
     uint32 l1Changed[4096];
 };
@@ -199,6 +228,12 @@ void startPXAtraps(struct irqData *data);
 void stopPXAtraps(struct irqData *data);
 int prepPXAtraps(struct irqData *data);
 
+int PXA_sample_tick(struct irqData *data);
+int PXA_irq_pending(struct irqData *data);
+void startPXAsampler(struct irqData *data);
+void stopPXAsampler(struct irqData *data);
+int prepPXAsampler(struct irqData *data);
+
 
 /****************************************************************
  * MMU based memory tracing (see l1trace.cpp)
@@ -220,5 +255,6 @@ void startMMUMerge(struct irqData *data);
 void __irq stopMMUMerge(struct irqData *data);
 void __irq checkMMUMerge(struct irqData *data);
 int prepMMUMerge(struct irqData *data);
+uint32 mmuMergeCount();
 void dumpMMUMerge(struct irqData *data);
 
@@ -10,8 +10,17 @@
 
 void __preload do_copy(char *dest, const char *src, int count);
 
+// Ways of starting a loaded kernel.
+enum {
+    BOOT_NOW,           // Shut down hardware and jump to it
+    BOOT_RESUME,        // Hook the resume vector and wait for a suspend
+    BOOT_STAGED,        // Hook the resume vector and return (see STAGEBOOT)
+};
+
+void unstageBoot();
+int isBootStaged();
 void bootRamLinux(const char *kernel, uint32 kernelSize
                   , const char *initrd, uint32 initrdSize
-                  , int bootViaResume=0);
+                  , int bootMode=BOOT_NOW);
 void bootHandleLinux(FILE *f, int kernelSize, int initrdSize, 
-		     int bootViaResume=0);
+		     int bootMode=BOOT_NOW);
@@ -20,6 +20,20 @@
 // Global current machine setting.
 extern class Machine *Mach;
 
+// A step of stopping a device before booting linux.  All steps are
+// started (in the order added) and then the ones with a done()
+// callback are polled together until they have all finished.
+struct quiesceStep {
+    const char *name;
+    int id;
+    void (*start)(void *data, int id);
+    int (*done)(void *data, int id);
+    void *data;
+    // Results (clock ticks from the start of shutdown).
+    uint32 ticks, polls, finished;
+};
+#define MAX_QUIESCE 48
+
 // Global detection mechanism
 void setupMachineType();
 
@@ -41,6 +55,20 @@ public:
     virtual void hardwareShutdown(struct fbinfo *);
     virtual int detect();
     void (*flushCache)(void);
+
+    // Device shutdown steps - added by preHardwareShutdown() and run
+    // by hardwareShutdown().
+    quiesceStep quiesceSteps[MAX_QUIESCE];
+    int quiesceCount;
+    uint32 quiesceTicks;
+    void addQuiesce(const char *name, int id
+                    , void (*start)(void *data, int id)
+                    , int (*done)(void *data, int id), void *data);
+    // Free running counter used to time the shutdown (0 if none).
+    virtual uint32 readClock();
+    uint32 clockKHz;
+    // Physical address of that counter (for use with the mmu off).
+    uint32 clockPhys;
 };
 
 // Register a machine class to be scanned during haret start.
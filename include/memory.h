@@ -74,7 +74,12 @@ extern uint8 *memPhysMap(uint32 paddr);
 extern void memPhysReset();
 extern uint32 memPhysRead(uint32 paddr);
 extern bool memPhysWrite(uint32 paddr, uint32 value);
+uint8 *memPhysMapRead(uint32 paddr, uint32 *len, int *cached);
+void memPhysReadDone(uint8 *vaddr, uint32 len, int cached);
+void reportSpeed(const char *what, uint32 bytes, uint32 msec, int cached);
 extern uint32 memVirtToPhys(uint32 vaddr);
+uint32 memVirtRun(uint32 vaddr, uint32 size, int *isMapped);
+uint32 safe_copy(void *dest, uint32 src, uint32 size);
 uint32 retryVirtToPhys(uint32 vaddr);
 void *cachedMVA(void *addr);
 
@@ -97,9 +102,24 @@ struct pageAddrs {
 void freePages(void *data);
 void *allocPages(struct pageAddrs *pages, int pageCount);
 
+// A set of pinned pages that is grown in fixed size chunks and can be
+// kept between users.  Zero initialize before first use.
+#define ARENA_CHUNK_PAGES 128
+#define ARENA_MAX_CHUNKS 64
+struct pageArena {
+    int pageCount, chunkCount;
+    void *chunks[ARENA_MAX_CHUNKS];
+    struct pageAddrs *pages;
+};
+int arenaAlloc(struct pageArena *pa, int pageCount);
+void arenaFree(struct pageArena *pa);
+
 struct continuousPageInfo;
 void freeContPages(struct continuousPageInfo *info);
 void *allocContPages(int pageCount, struct continuousPageInfo **info);
+void *getContPool(int pageCount);
+void putContPool();
+void freeContPool();
 
 // Test if 'addr' is in the range from 'start'..'start+size'
 #define IN_RANGE(addr, start, size) ({   \
@@ -120,6 +140,8 @@ void *allocContPages(int pageCount, struct continuousPageInfo **info);
 // The size of physical memory to map at once
 #define PHYS_CACHE_SIZE 0x10000
 #define PHYS_CACHE_MASK (PHYS_CACHE_SIZE - 1)
+// The amount of physical memory locations to cache
+#define PHYS_CACHE_COUNT 8
 
 extern uint32 memPhysAddr;
 extern uint32 memPhysSize;
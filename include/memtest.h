@@ -0,0 +1,34 @@
+#ifndef __MEMTEST_H
+#define __MEMTEST_H
+
+// Ram test patterns.  The code behind this header only depends on
+// xtypes.h so that it can also be built and run against a malloc'd
+// buffer on a host.
+
+#include "xtypes.h" // uint32
+
+struct memtestOps {
+    // Called between writing and verifying memory (eg, to flush the
+    // cpu cache so that the verify reads come from ram).  May be 0.
+    void (*sync)(void);
+    // Called for each mismatching word (<offset> is in bytes).
+    void (*error)(void *data, uint32 offset, uint32 expect, uint32 got);
+    void *data;
+    // Number of mismatching words found.
+    uint32 errors;
+};
+
+struct memtestPattern {
+    const char *name;
+    // Test <words> words at <buf>.  <base> is the address reported
+    // for <buf> in the address tests and <seed> seeds random data.
+    void (*run)(uint32 *buf, uint32 words, uint32 base, uint32 seed
+                , struct memtestOps *ops);
+    // Number of times each word is read or written by a run.
+    uint32 accesses;
+};
+
+extern const struct memtestPattern MemtestPatterns[];
+extern const int MemtestPatternCount;
+
+#endif // memtest.h
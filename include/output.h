@@ -52,5 +52,7 @@ public:
 
 // Setup the output function for this thread.
 outputfn *setOutputFn(outputfn *ofn);
+// Setup an output function that receives output from all threads.
+outputfn *setGlobalOutputFn(outputfn *ofn);
 
 #endif /* _MSGBOX_H */
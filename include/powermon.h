@@ -0,0 +1,14 @@
+#ifndef __POWERMON_H
+#define __POWERMON_H
+
+#include "xtypes.h" // uint32
+
+int powerSampleStart(uint32 interval);
+void powerSamplePoll(uint32 events);
+void powerSampleFinish(const char *fn);
+void powerSampleStop();
+
+extern uint32 WirqPower;
+extern char *WirqPowerFile;
+
+#endif // powermon.h
@@ -11,6 +11,17 @@ WINBASEAPI DWORD SetSystemMemoryDivision(DWORD);
 #define SYSMEM_REBOOTPENDING 2
 #define SYSMEM_FAILED 3
 
+WINBASEAPI DWORD SetSystemPowerState(LPCWSTR, DWORD, DWORD);
+#ifndef POWER_STATE_SUSPEND
+#define POWER_STATE_SUSPEND 0x00200000
+#endif
+#ifndef POWER_FORCE
+#define POWER_FORCE 0x00001000
+#endif
+#ifndef VK_OFF
+#define VK_OFF 0xDF
+#endif
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,33 @@
+#ifndef __REGNAMES_H
+#define __REGNAMES_H
+
+#include "xtypes.h" // uint32
+
+// Register name tables - these are generated from the haretconsole
+// register definitions by tools/buildregs.py.
+struct regBitName {
+    uint32 mask;
+    const char *name;
+};
+
+struct regName {
+    uint32 paddr;
+    const char *name;
+    const struct regBitName *bits;
+    uint32 bitCount;
+};
+
+struct regTable {
+    const char *mach;
+    const struct regName *regs;
+    uint32 count;
+};
+
+extern const struct regTable RegTables[];
+extern const int RegTableCount;
+
+const struct regName *regLookup(uint32 paddr);
+void regAnnotate(char *buf, int len, uint32 paddr, uint32 val, uint32 changed);
+void regDumpRange(uint32 paddr, uint32 size);
+
+#endif // regnames.h
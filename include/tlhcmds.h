@@ -0,0 +1,10 @@
+#ifndef __TLHCMDS_H
+#define __TLHCMDS_H
+
+#include "xtypes.h" // uint32
+
+void modIndexRefresh();
+const char *modLookup(uint32 addr, uint32 *offset);
+void modAnnotate(char *buf, int len, uint32 addr);
+
+#endif // tlhcmds.h
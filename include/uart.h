@@ -14,6 +14,8 @@ struct uart_drv
 {
   void  (*setup) (void);
   void  (*puts) (char *ch);
+  // Optional non-blocking write - returns number of bytes accepted.
+  int   (*write) (const char *buf, int len);
 };
 
 extern void UART_puts(char *s);
@@ -12,5 +12,7 @@ extern uint16 *vidGetVirtVRAM();
 extern uint32 vidGetVRAM();
 
 extern uint videoW, videoH;
+extern uint videoBPP;
+extern int videoXStride, videoYStride;
 
 #endif /* _VIDEO_H */
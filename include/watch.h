@@ -16,8 +16,13 @@ struct memcheck {
         uint32 insn;
     };
     uint32 rangesize;
+    // Block of words read and reported when this entry triggers.
+    uint32 captureAddr, captureCount;
 };
 
+// Maximum number of words in a capture block.
+#define MAX_CAPTURE 32
+
 int testChanged(struct memcheck *mc, uint32 curval, uint32 *pchanged);
 int testMem(struct memcheck *mc, uint32 *pnewval, uint32 *pchanged);
 void get_suppress(const char *args, memcheck *mc);
@@ -31,6 +36,9 @@ class watchListVar : public listVarBase {
 public:
     uint32 watchcount;
     memcheck watchlist[64];
+    // Physical addresses of the watched locations (from beginWatch).
+    uint32 watchpaddr[64];
+    uint32 capturepaddr[64];
     watchListVar(predFunc ta, const char *n, const char *d)
         : listVarBase("var_list_watch", ta, n, d, &watchcount, (void*)watchlist
                       , sizeof(watchlist[0]), ARRAY_SIZE(watchlist))
@@ -42,6 +50,8 @@ public:
     void beginWatch(int isStart=1);
     void reportWatch(const char *header, uint32 pos
                      , uint32 newval, uint32 changed, uint32 pc=0);
+    void reportCapture(const char *header, uint32 pos
+                       , uint32 idx, uint32 val);
 };
 #define REG_VAR_WATCHLIST(Pred, Name, Var, Desc)       \
     __REG_VAR(watchListVar, Var, Pred, Name, Desc)
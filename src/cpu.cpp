@@ -6,6 +6,7 @@
 */
 
 #include "windows.h"
+#include "pkfuncs.h" // LockPages
 #include <stdio.h> // sprintf
 
 #include "output.h" // Output
@@ -202,6 +203,63 @@ touchAppPages(void)
     touchPages(&_bss_start, &_bss_end);
 }
 
+static struct appSection {
+    uint32 *start, *end;
+    int flags;
+} AppSections[] = {
+    { &_text_start, &_text_end, LOCKFLAG_READ },
+    { &_rdata_start, &_rdata_end, LOCKFLAG_READ },
+    { &_data_start, &_data_end, LOCKFLAG_WRITE },
+    { &_bss_start, &_bss_end, LOCKFLAG_WRITE },
+};
+
+// Set when all the application pages are locked in memory - in that
+// case they can't be paged out and take_control doesn't need to
+// touch them.
+static int AppPagesLocked;
+
+static void
+unlockSections(int count)
+{
+    for (int i=0; i<count; i++) {
+        struct appSection *as = &AppSections[i];
+        UnlockPages(as->start, (char*)as->end - (char*)as->start);
+    }
+}
+
+// Pin the whole haret image in memory once (instead of touching
+// every page each time a critical section is entered).  If the
+// kernel refuses, take_control falls back to touching the pages.
+void
+lockAppPages()
+{
+    if (AppPagesLocked)
+        return;
+    uint32 start_time = GetTickCount();
+    for (uint i=0; i<ARRAY_SIZE(AppSections); i++) {
+        struct appSection *as = &AppSections[i];
+        if (!LockPages(as->start, (char*)as->end - (char*)as->start
+                       , NULL, as->flags)) {
+            Output(C_WARN "Unable to lock haret pages (code %ld)"
+                   " - will touch them on each use", GetLastError());
+            unlockSections(i);
+            return;
+        }
+    }
+    AppPagesLocked = 1;
+    Output("Locked haret image in memory (%d ms)"
+           , GetTickCount() - start_time);
+}
+
+void
+unlockAppPages()
+{
+    if (!AppPagesLocked)
+        return;
+    unlockSections(ARRAY_SIZE(AppSections));
+    AppPagesLocked = 0;
+}
+
 static int controlCount;
 
 // Take over CPU control from wince.  After calling this, the
@@ -219,7 +277,8 @@ take_control()
     flushLogFile();
 
     // Map in pages to prevent page faults in critical section.
-    touchAppPages();
+    if (!AppPagesLocked)
+        touchAppPages();
 
     // Disable interrupts.
     unsigned long temp;
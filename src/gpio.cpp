@@ -5,8 +5,6 @@
     For conditions of use see file COPYING
 */
 
-#include <time.h>
-
 #include "xtypes.h"
 #include "gpio.h"
 #include "memory.h"
@@ -14,12 +12,6 @@
 #include "script.h" // REG_VAR_BITSET
 #include "arch-pxa.h" // testPXA
 
-// Which GPIO changes to ignore during watch
-uint32 gpioIgnore [3] = { 0, 0, 0 };
-
-REG_VAR_BITSET(testPXA, "IGPIO", gpioIgnore, 84
-               , "The list of GPIOs to ignore during WGPIO")
-
 void gpioSetDir (int num, bool out)
 {
   if (num > 84)
@@ -109,105 +101,6 @@ void gpioSetSleepState (int num, bool state)
     pgsr [ofs] &= ~mask;
 }
 
-// Watch for given number of seconds which GPIO pins change
-static void gpioWatch (uint seconds)
-{
-  if (seconds > 60)
-  {
-    Output(C_INFO "Number of seconds trimmed to 60");
-    seconds = 60;
-  }
-
-  int cur_time = time (NULL);
-  int fin_time = cur_time + seconds;
-  int i, j;
-
-  uint32 *gplr = (uint32 *)memPhysMap (GPLR0);
-  uint32 old_gplr [3];
-  for (i = 0; i < 3; i++)
-    old_gplr [i] = gplr [i];
-
-  uint32 *gpdr = (uint32 *)memPhysMap (GPDR0);
-  uint32 old_gpdr [3];
-  for (i = 0; i < 3; i++)
-    old_gpdr [i] = gpdr [i];
-
-  uint32 *gafr = (uint32 *)memPhysMap (GAFR0_L);
-  uint32 old_gafr [6];
-  for (i = 0; i < 6; i++)
-    old_gafr [i] = gafr [i];
-
-  while (cur_time <= fin_time)
-  {
-    gplr = (uint32 *)memPhysMap (GPLR0);
-    for (i = 0; i < 3; i++)
-    {
-      uint32 val = gplr [i];
-      if (old_gplr [i] != val)
-      {
-        uint32 changes = (old_gplr [i] ^ val) & ~gpioIgnore [i];
-        for (j = 0; j < 32; j++)
-          if ((changes & (1 << j))
-	   && ((i * 32 + j) <= 84))
-	  {
-            Screen("GPLR[%d] changed to %d", i * 32 + j, (val >> j) & 1);
-          }
-        old_gplr [i] = val;
-      }
-    }
-
-    gpdr = (uint32 *)memPhysMap (GPDR0);
-    for (i = 0; i < 3; i++)
-    {
-      uint32 val = gpdr [i];
-      if (old_gpdr [i] != val)
-      {
-        uint32 changes = (old_gpdr [i] ^ val) & ~gpioIgnore [i];
-        for (j = 0; j < 32; j++)
-          if ((changes & (1 << j))
-	   && ((i * 32 + j) <= 84))
-	  {
-            Screen("GPDR[%d] changed to %d", i * 32 + j, (val >> j) & 1);
-	  }
-        old_gpdr [i] = val;
-      }
-    }
-
-    gafr = (uint32 *)memPhysMap (GAFR0_L);
-    for (i = 0; i < 6; i++)
-    {
-      uint32 val = gafr [i];
-      if (old_gafr [i] != val)
-      {
-        uint32 changes = old_gafr [i] ^ val;
-        for (j = 0; j < 16; j++)
-          if (changes & (3 << j * 2)
-	   && ((i * 32 + j) <= 83))
-	  {
-            Screen("GAFR[%d] changed to %d", i * 16 + j, (changes >> j * 2) & 3);
-	  }
-        old_gafr [i] = val;
-      }
-    }
-
-    cur_time = time (NULL);
-  }
-}
-
-static void
-cmd_wgpio(const char *cmd, const char *x)
-{
-    uint32 sec;
-    if (!get_expression(&x, &sec)) {
-        ScriptError("Expected <seconds>");
-        return;
-    }
-    gpioWatch(sec);
-}
-REG_CMD(testPXA, "WG|PIO", cmd_wgpio,
-        "WGPIO <seconds>\n"
-        "  Watch GPIO pins for given period of time and report changes.")
-
 static uint32 gpioScrGPLR (bool setval, uint32 *args, uint32 val)
 {
   if (args [0] > 84)
@@ -0,0 +1,269 @@
+/* Watch gpio registers for changes.
+ *
+ * For conditions of use see file COPYING
+ */
+
+#include <windows.h> // Sleep, GetTickCount
+#include <stdio.h> // _snprintf
+#include <stdlib.h> // calloc
+#include <string.h> // strncpy
+
+#include "xtypes.h"
+#include "output.h" // Output
+#include "script.h" // REG_CMD
+#include "memory.h" // memPhysMap
+
+
+/****************************************************************
+ * Gpio banks
+ ****************************************************************/
+
+// A bank is a run of consecutive 32bit registers where each pin is
+// described by 'bits' bits (eg, 1 for levels, 2 for pxa alternate
+// functions).  Banks are declared by each Machine::init() (see
+// "addgpiobank").
+struct gpioBank {
+    char name[16];
+    uint32 paddr;
+    uint32 words, bits, firstPin;
+};
+
+#define MAX_GPIOBANKS 16
+#define MAX_GPIOWORDS 64
+static gpioBank GpioBanks[MAX_GPIOBANKS];
+static uint GpioBankCount, GpioWordCount;
+
+static void
+cmd_addgpiobank(const char *cmd, const char *args)
+{
+    char name[MAX_CMDLEN];
+    uint32 paddr, words, bits, firstPin;
+    if (get_token(&args, name, sizeof(name))
+        || !get_expression(&args, &paddr)
+        || !get_expression(&args, &words)) {
+        ScriptError("Expected <name> <paddr> <words> [<bits> [<firstpin>]]");
+        return;
+    }
+    if (!get_expression(&args, &bits))
+        bits = 1;
+    if (!get_expression(&args, &firstPin))
+        firstPin = 0;
+    if ((bits != 1 && bits != 2 && bits != 4) || (paddr & 3) || !words) {
+        ScriptError("Invalid gpio bank");
+        return;
+    }
+    if (GpioBankCount >= MAX_GPIOBANKS
+        || GpioWordCount + words > MAX_GPIOWORDS) {
+        ScriptError("Too many gpio banks");
+        return;
+    }
+    gpioBank *gb = &GpioBanks[GpioBankCount++];
+    strncpy(gb->name, name, sizeof(gb->name));
+    gb->name[sizeof(gb->name)-1] = 0;
+    gb->paddr = paddr;
+    gb->words = words;
+    gb->bits = bits;
+    gb->firstPin = firstPin;
+    GpioWordCount += words;
+}
+REG_CMD(0, "ADDGPIOBANK", cmd_addgpiobank,
+        "ADDGPIOBANK <name> <paddr> <words> [<bits> [<firstpin>]]\n"
+        "  Add a bank of gpio registers to be watched by WGPIO.  Each pin\n"
+        "  uses <bits> bits (default 1) and the first pin is numbered\n"
+        "  <firstpin> (default 0).")
+
+// Which GPIO changes to ignore during watch
+#define MAX_GPIOPINS 512
+static uint32 gpioIgnore[MAX_GPIOPINS / 32];
+REG_VAR_BITSET(0, "IGPIO", gpioIgnore, MAX_GPIOPINS
+               , "The list of GPIOs to ignore during WGPIO")
+
+
+/****************************************************************
+ * Watching
+ ****************************************************************/
+
+struct gpioWatchState {
+    volatile uint32 *regs[MAX_GPIOBANKS];
+    // Set if the banks span more memPhysMap windows than it caches -
+    // the mappings then have to be looked up on every poll.
+    int remap;
+    // Changed bits to report for each register.
+    uint32 mask[MAX_GPIOWORDS];
+    uint32 last[MAX_GPIOWORDS];
+    // Bits that changed since the last report, and the number of
+    // changes of each pin in that time.
+    uint32 pending[MAX_GPIOWORDS];
+    uint16 toggles[MAX_GPIOWORDS * 32];
+};
+
+// Build the report mask of a bank register from the IGPIO list.
+static uint32
+ignoreMask(gpioBank *gb, uint32 word)
+{
+    uint32 mask = ~0;
+    uint32 pinsPerWord = 32 / gb->bits;
+    for (uint32 i=0; i<pinsPerWord; i++) {
+        uint32 pin = gb->firstPin + word * pinsPerWord + i;
+        if (pin < MAX_GPIOPINS && gpioIgnore[pin / 32] & (1 << (pin % 32)))
+            mask &= ~(((1 << gb->bits) - 1) << (i * gb->bits));
+    }
+    return mask;
+}
+
+// Read all the banks; note changes (a simple xor of the old and new
+// values).  Returns non-zero if anything reportable changed.
+static int
+gpioPoll(gpioWatchState *ws)
+{
+    int found = 0;
+    uint32 *last = ws->last, *mask = ws->mask, *pending = ws->pending;
+    uint16 *toggles = ws->toggles;
+    for (uint b=0; b<GpioBankCount; b++) {
+        gpioBank *gb = &GpioBanks[b];
+        volatile uint32 *regs = ws->regs[b];
+        if (ws->remap)
+            regs = (volatile uint32*)memPhysMap(gb->paddr);
+        for (uint32 w=0; w<gb->words; w++) {
+            uint32 val = regs[w];
+            uint32 changes = (val ^ last[w]) & mask[w];
+            last[w] = val;
+            if (changes) {
+                found = 1;
+                pending[w] |= changes;
+                for (uint32 bit=0; bit<32; bit+=gb->bits)
+                    if (changes & (((1 << gb->bits) - 1) << bit))
+                        toggles[w*32 + bit]++;
+            }
+        }
+        last += gb->words;
+        mask += gb->words;
+        pending += gb->words;
+        toggles += gb->words * 32;
+    }
+    return found;
+}
+
+// Report all pending changes on a single line (as long as it fits).
+static void
+gpioReport(gpioWatchState *ws, uint32 msec)
+{
+    char buf[200];
+    int len = _snprintf(buf, sizeof(buf), "%06d:", msec);
+    uint32 *last = ws->last, *pending = ws->pending;
+    uint16 *toggles = ws->toggles;
+    for (uint b=0; b<GpioBankCount; b++) {
+        gpioBank *gb = &GpioBanks[b];
+        uint32 pinsPerWord = 32 / gb->bits;
+        int shownBank = 0;
+        for (uint32 w=0; w<gb->words; w++) {
+            if (!pending[w])
+                continue;
+            for (uint32 i=0; i<pinsPerWord; i++) {
+                uint32 bit = i * gb->bits;
+                uint32 pmask = ((1 << gb->bits) - 1) << bit;
+                if (!(pending[w] & pmask))
+                    continue;
+                if (len > (int)sizeof(buf) - 40) {
+                    Output("%s", buf);
+                    len = _snprintf(buf, sizeof(buf), "%06d:", msec);
+                    shownBank = 0;
+                }
+                if (!shownBank) {
+                    len += _snprintf(&buf[len], sizeof(buf) - len
+                                     , " %s", gb->name);
+                    shownBank = 1;
+                }
+                uint32 pin = gb->firstPin + w * pinsPerWord + i;
+                uint32 val = (last[w] & pmask) >> bit;
+                uint16 count = toggles[w*32 + bit];
+                if (count > 1)
+                    len += _snprintf(&buf[len], sizeof(buf) - len
+                                     , " %d=%d(x%d)", pin, val, count);
+                else
+                    len += _snprintf(&buf[len], sizeof(buf) - len
+                                     , " %d=%d", pin, val);
+                toggles[w*32 + bit] = 0;
+            }
+            pending[w] = 0;
+        }
+        last += gb->words;
+        pending += gb->words;
+        toggles += gb->words * 32;
+    }
+    Output("%s", buf);
+}
+
+static void
+cmd_wgpio(const char *cmd, const char *args)
+{
+    uint32 seconds, interval;
+    if (!get_expression(&args, &seconds)) {
+        ScriptError("Expected <seconds> [<msec>]");
+        return;
+    }
+    if (!get_expression(&args, &interval))
+        interval = 0;
+    if (!GpioBankCount) {
+        Output(C_ERROR "No gpio banks defined for this machine");
+        return;
+    }
+
+    gpioWatchState *ws = (gpioWatchState*)calloc(1, sizeof(*ws));
+    if (!ws) {
+        Output(C_ERROR "Unable to allocate watch state");
+        return;
+    }
+    uint32 windows[MAX_GPIOBANKS], windowCount = 0;
+    uint32 pos = 0;
+    for (uint b=0; b<GpioBankCount; b++) {
+        gpioBank *gb = &GpioBanks[b];
+        uint32 win = gb->paddr / (PHYS_CACHE_SIZE/2), i;
+        for (i=0; i<windowCount; i++)
+            if (windows[i] == win)
+                break;
+        if (i == windowCount)
+            windows[windowCount++] = win;
+        ws->regs[b] = (volatile uint32*)memPhysMap(gb->paddr);
+        if (!ws->regs[b]) {
+            Output(C_ERROR "Unable to map gpio bank %s", gb->name);
+            free(ws);
+            return;
+        }
+        for (uint32 w=0; w<gb->words; w++, pos++) {
+            ws->mask[pos] = ignoreMask(gb, w);
+            ws->last[pos] = ws->regs[b][w];
+        }
+    }
+
+    ws->remap = windowCount > PHYS_CACHE_COUNT;
+
+    Output("Watching %d gpio banks for %d seconds", GpioBankCount, seconds);
+    uint32 start_time = GetTickCount(), last_report = 0, polls = 0;
+    uint32 duration = seconds * 1000;
+    int havePending = 0;
+    for (;;) {
+        uint32 now = GetTickCount() - start_time;
+        if (now >= duration)
+            break;
+        havePending |= gpioPoll(ws);
+        polls++;
+        // With an interval, changes are collected and reported (with
+        // toggle counts) at most once per interval.
+        if (havePending && now - last_report >= interval) {
+            gpioReport(ws, now);
+            last_report = now;
+            havePending = 0;
+        }
+        Sleep(1);
+    }
+    if (havePending)
+        gpioReport(ws, GetTickCount() - start_time);
+    Output("Finished watching gpios (%d polls)", polls);
+    free(ws);
+}
+REG_CMD(0, "WG|PIO", cmd_wgpio,
+        "WGPIO <seconds> [<msec>]\n"
+        "  Watch GPIO pins for given period of time and report changes.\n"
+        "  If <msec> is given, changes are collected and reported (with\n"
+        "  the number of times each pin changed) at most every <msec>.")
@@ -9,6 +9,7 @@
 #include "pkfuncs.h" // AllocPhysMem
 #include <string.h> // memcpy
 #include <stdio.h> // _snprintf
+#include <stddef.h> // offsetof
 
 #include "xtypes.h"
 #include "watch.h" // memcheck
@@ -18,6 +19,8 @@
 #include "machines.h" // Mach
 #include "lateload.h" // LATE_LOAD
 #include "winvectors.h" // findWinCEirq
+#include "powermon.h" // powerSamplePoll
+#include "linboot.h" // isBootStaged
 #include "irq.h"
 
 /*
@@ -88,6 +91,25 @@ report_memPoll(irqData *data, const char *header, traceitem *item)
     w->reportWatch(header, pos, val, changed, pc);
 }
 
+static void
+report_capture(irqData *data, const char *header, traceitem *item)
+{
+    watchListVar *w = (watchListVar*)item->d0;
+    w->reportCapture(header, item->d1, item->d2, item->d3);
+}
+
+// Read the capture block of a watch entry that just triggered.
+static void __irq
+captureBlock(struct irqData *data, pollinfo *info, uint32 pos)
+{
+    memcheck *mc = &info->list[pos];
+    volatile uint32 *addr = (volatile uint32 *)mc->captureAddr;
+    for (uint i=0; i<mc->captureCount; i++)
+        if (add_trace(data, report_capture, (uint32)info->cls, pos, i
+                      , addr[i]))
+            break;
+}
+
 // Perform a set of memory polls and add to trace buffer.
 static void __irq
 checkPolls(struct irqData *data, pollinfo *info, uint32 pc = 0)
@@ -103,73 +125,164 @@ checkPolls(struct irqData *data, pollinfo *info, uint32 pc = 0)
         if (ret)
             // Couldn't add trace - reset compare function.
             mc->trySuppress = 0;
+        else if (mc->captureCount)
+            captureBlock(data, info, i);
     }
 }
 
+
+/****************************************************************
+ * Exception handler variants
+ ****************************************************************/
+
+// Each exception handler is built once for every combination of the
+// optional features below, and cmd_wirq installs the variants that
+// match what is enabled for the session.  A feature that isn't
+// compiled into a variant costs nothing at exception time.
+enum {
+    // PXA clock stamps, debug traps, and poll bracketing.
+    HF_PXA = 1<<0,
+    // IRQS/TRACES memory polling (only TRACES for abort/prefetch).
+    HF_POLL = 1<<1,
+    // MMU L1 table merging.
+    HF_MERGE = 1<<2,
+    // Fixed rate sampling timer (irq) or L1 traps (abort/prefetch).
+    HF_SAMPLE = 1<<3,
+    HF_L1 = 1<<3,
+
+    HF_ALL = 0xf,
+};
+#define HANDLER_VARIANTS(DEF)                                   \
+    DEF(0) DEF(1) DEF(2) DEF(3) DEF(4) DEF(5) DEF(6) DEF(7)     \
+    DEF(8) DEF(9) DEF(10) DEF(11) DEF(12) DEF(13) DEF(14) DEF(15)
+
+#define __variant inline __irq __attribute__((always_inline))
+
 // Handler for interrupt events.  Note that this is running in
 // "Modified Virtual Address" mode, so avoid reading any global
-// variables or calling any non local functions.
-extern "C" void __irq
-irq_handler(struct irqData *data, struct irqregs *regs)
+// variables or calling any non local functions.  Returns non-zero if
+// wince shouldn't see the interrupt.
+static __variant int
+irqHandler(struct irqData *data, uint32 old_pc, const int features)
 {
-    int isPXA = data->isPXA;
+    int isPXA = features & HF_PXA;
     getClock(data, isPXA);
-    data->irqCount++;
+
+    // Ticks of the WIRQRATE timer are not counted as wince irqs.
+    int sample = (features & HF_SAMPLE) && PXA_sample_tick(data);
+    if (!sample)
+        data->irqCount++;
 
     if (isPXA)
         // Separate routine for PXA chips
-        PXA_irq_handler(data, regs);
+        PXA_irq_handler(data, NULL);
+    uint32 start = data->clock;
 
     // Trace time memory polling.
-    prePoll(data, isPXA);
-    checkPolls(data, &data->irqpoll);
-    checkPolls(data, &data->tracepoll, MVAddr_irq(regs->old_pc - 4));
-    checkMMUMerge(data);
-    postPoll(data, isPXA);
+    if (features & (HF_POLL | HF_MERGE)) {
+        prePoll(data, isPXA);
+        if (features & HF_POLL) {
+            checkPolls(data, &data->irqpoll);
+            checkPolls(data, &data->tracepoll, MVAddr_irq(old_pc - 4));
+        }
+        if (features & HF_MERGE)
+            checkMMUMerge(data);
+        postPoll(data, isPXA);
+    }
+
+    if (isPXA) {
+        data->irqCycles += get_CCNT() - start;
+        data->irqCycleCount++;
+    }
+
+    // Only hand the interrupt to wince if something else is pending.
+    return sample && !PXA_irq_pending(data);
 }
 
-extern "C" int __irq
-abort_handler(struct irqData *data, struct irqregs *regs)
+static __variant int
+abortHandler(struct irqData *data, struct irqregs *regs, const int features)
 {
-    int isPXA = data->isPXA;
+    int isPXA = features & HF_PXA;
     getClock(data, isPXA);
     data->abortCount++;
 
-    int ret = L1_abort_handler(data, regs);
+    int ret = 0;
+    if (features & HF_L1)
+        ret = L1_abort_handler(data, regs);
     if (!ret && isPXA)
         // Separate routine for PXA chips
         ret = PXA_abort_handler(data, regs);
 
     // Trace time memory polling.
-    prePoll(data, isPXA);
-    checkPolls(data, &data->tracepoll, MVAddr_irq(regs->old_pc - 4));
-    checkMMUMerge(data);
-    postPoll(data, isPXA);
+    if (features & (HF_POLL | HF_MERGE)) {
+        prePoll(data, isPXA);
+        if (features & HF_POLL)
+            checkPolls(data, &data->tracepoll, MVAddr_irq(regs->old_pc - 4));
+        if (features & HF_MERGE)
+            checkMMUMerge(data);
+        postPoll(data, isPXA);
+    }
 
     return ret;
 }
 
-extern "C" int __irq
-prefetch_handler(struct irqData *data, struct irqregs *regs)
+static __variant int
+prefetchHandler(struct irqData *data, struct irqregs *regs, const int features)
 {
-    int isPXA = data->isPXA;
+    int isPXA = features & HF_PXA;
     getClock(data, isPXA);
     data->prefetchCount++;
 
-    int ret = L1_prefetch_handler(data, regs);
+    int ret = 0;
+    if (features & HF_L1)
+        ret = L1_prefetch_handler(data, regs);
     if (!ret && isPXA)
         // Separate routine for PXA chips
         ret = PXA_prefetch_handler(data, regs);
 
     // Trace time memory polling.
-    prePoll(data, isPXA);
-    checkPolls(data, &data->tracepoll, MVAddr_irq(regs->old_pc - 4));
-    checkMMUMerge(data);
-    postPoll(data, isPXA);
+    if (features & (HF_POLL | HF_MERGE)) {
+        prePoll(data, isPXA);
+        if (features & HF_POLL)
+            checkPolls(data, &data->tracepoll, MVAddr_irq(regs->old_pc - 4));
+        if (features & HF_MERGE)
+            checkMMUMerge(data);
+        postPoll(data, isPXA);
+    }
 
     return ret;
 }
 
+typedef int (*irqHandlerFunc)(struct irqData *, uint32);
+typedef int (*excHandlerFunc)(struct irqData *, struct irqregs *);
+
+#define DEF_VARIANTS(F)                                                 \
+    static int __irq irq_handler_##F(struct irqData *data, uint32 pc) { \
+        return irqHandler(data, pc, F);                                 \
+    }                                                                   \
+    static int __irq abort_handler_##F(struct irqData *data             \
+                                       , struct irqregs *regs) {        \
+        return abortHandler(data, regs, F);                             \
+    }                                                                   \
+    static int __irq prefetch_handler_##F(struct irqData *data          \
+                                          , struct irqregs *regs) {     \
+        return prefetchHandler(data, regs, F);                          \
+    }
+HANDLER_VARIANTS(DEF_VARIANTS)
+
+#define IRQ_VARIANT(F) irq_handler_##F,
+#define ABORT_VARIANT(F) abort_handler_##F,
+#define PREFETCH_VARIANT(F) prefetch_handler_##F,
+static const irqHandlerFunc IrqHandlers[] = {
+    HANDLER_VARIANTS(IRQ_VARIANT)
+};
+static const excHandlerFunc AbortHandlers[] = {
+    HANDLER_VARIANTS(ABORT_VARIANT)
+};
+static const excHandlerFunc PrefetchHandlers[] = {
+    HANDLER_VARIANTS(PREFETCH_VARIANT)
+};
+
 static void
 report_resume(irqData *, const char *header, traceitem *item)
 {
@@ -274,12 +387,16 @@ mainLoop(struct irqData *data, int seconds)
                 continue;
             // Hrmm.  Recheck the current time so that we don't run
             // away reporting traces.
-        } else {
+        } else if (data->exitEarly) {
+            break;
+        }
+        // Sample power after each batch of traces too (it limits its
+        // own rate) - bursts are what it should be correlated with.
+        powerSamplePoll(data->irqCount + data->abortCount
+                        + data->prefetchCount);
+        if (!ret)
             // Nothing to report; yield the cpu.
-            if (data->exitEarly)
-                break;
             late_SleepTillTick();
-        }
         cur_time = GetTickCount();
         tmpcount = 0;
         if (cur_time >= fin_time)
@@ -301,9 +418,134 @@ postLoop(struct irqData *data)
     Output("Handled %d irq, %d abort, %d prefetch, %d lost, %d errors"
            , data->irqCount, data->abortCount, data->prefetchCount
            , data->overflows, data->errors);
+    if (data->ostRegs)
+        Output("Took %d timer samples (%d late)"
+               , data->sampleCount, data->sampleLate);
+    if (data->irqCycleCount)
+        Output("irq handler took %d cycles on average (%d irqs)"
+               , (uint32)(data->irqCycles / data->irqCycleCount)
+               , data->irqCycleCount);
 }
 
 
+/****************************************************************
+ * Cache footprint of the irq handler
+ ****************************************************************/
+
+// Fields of irqData used by the irq handler and the handler features
+// (see HF_*) that use them (0 = always).  Lines only written when a
+// trace is added are not counted.
+#define IRQFIELD(field, features)                                       \
+    { #field, offsetof(irqData, field), sizeof(((irqData*)0)->field)    \
+      , features }
+static const struct irqField {
+    const char *name;
+    uint32 offset, size;
+    int features;
+} IrqFields[] = {
+    IRQFIELD(irqCount, 0),
+    IRQFIELD(clock, HF_PXA),
+    IRQFIELD(dbcon, HF_PXA),
+    IRQFIELD(irqCycles, HF_PXA),
+    IRQFIELD(irqCycleCount, HF_PXA),
+    IRQFIELD(ostRegs, HF_SAMPLE),
+    IRQFIELD(intcRegs, HF_SAMPLE),
+    IRQFIELD(sampleChannel, HF_SAMPLE),
+    IRQFIELD(sampleInterval, HF_SAMPLE),
+    IRQFIELD(sampleCount, HF_SAMPLE),
+    IRQFIELD(sampleLate, HF_SAMPLE),
+    IRQFIELD(sampleICIP2, HF_SAMPLE),
+    IRQFIELD(irqpoll.count, HF_POLL),
+    IRQFIELD(tracepoll.count, HF_POLL),
+    IRQFIELD(mergeTableCount, HF_MERGE),
+    IRQFIELD(mergeTableStart, HF_MERGE),
+    IRQFIELD(mmuVAddr, HF_MERGE),
+};
+
+// Add the cache lines covering <size> bytes at <offset> to the set
+// of <count> lines in <lines>.  Returns the new count.
+static uint
+addLines(uint32 *lines, uint count, uint max, uint32 offset, uint32 size)
+{
+    if (!size)
+        return count;
+    for (uint32 l = offset / DCACHE_LINE
+             ; l <= (offset + size - 1) / DCACHE_LINE; l++) {
+        uint i;
+        for (i=0; i<count; i++)
+            if (lines[i] == l)
+                break;
+        if (i == count && count < max)
+            lines[count++] = l;
+    }
+    return count;
+}
+
+// Count the distinct cache lines of irqData that an irq handler with
+// <features> touches when <irqPolls> and <tracePolls> entries are
+// being polled and <mergeCount> l1 entries are merged.
+static uint
+countIrqLines(int features, uint32 irqPolls, uint32 tracePolls
+              , uint32 mergeCount, int verbose)
+{
+    uint32 lines[128];
+    uint count = 0;
+    for (uint i=0; i<ARRAY_SIZE(IrqFields); i++) {
+        const irqField *f = &IrqFields[i];
+        if (f->features && !(f->features & features))
+            continue;
+        count = addLines(lines, count, ARRAY_SIZE(lines), f->offset, f->size);
+        if (verbose)
+            Output("  %-16s offset %05x line %d"
+                   , f->name, f->offset, f->offset / DCACHE_LINE);
+    }
+    if ((features & HF_MERGE) && mergeCount) {
+        // checkMMUMerge reads the l1 copy on every irq.  It is up to
+        // 16K and far from the fields above, so count it directly.
+        uint32 l1Copy = offsetof(irqData, l1Copy);
+        count += ((l1Copy + mergeCount * 4 - 1) / DCACHE_LINE
+                  - l1Copy / DCACHE_LINE + 1);
+        if (verbose)
+            Output("  l1Copy           offset %05x %d entries"
+                   , l1Copy, mergeCount);
+    }
+    if (!(features & HF_POLL))
+        return count;
+    uint32 irqList = offsetof(irqData, irqpoll.list);
+    uint32 traceList = offsetof(irqData, tracepoll.list);
+    count = addLines(lines, count, ARRAY_SIZE(lines)
+                     , irqList, irqPolls * sizeof(memcheck));
+    count = addLines(lines, count, ARRAY_SIZE(lines)
+                     , traceList, tracePolls * sizeof(memcheck));
+    if (verbose) {
+        Output("  irqpoll.list     offset %05x %d entries", irqList, irqPolls);
+        Output("  tracepoll.list   offset %05x %d entries"
+               , traceList, tracePolls);
+    }
+    return count;
+}
+
+static void
+cmd_irqlines(const char *cmd, const char *args)
+{
+    uint32 features = HF_ALL;
+    get_expression(&args, &features);
+    uint count = countIrqLines(
+        features, min(IRQS.watchcount, MAX_MEMCHECK)
+        , min(TRACES.watchcount, MAX_MEMCHECK), mmuMergeCount(), 1);
+    Output("irq handler (features %x) touches %d of %d %d byte cache lines"
+           " of wirq data", features, count
+           , (int)((sizeof(irqData) + DCACHE_LINE - 1) / DCACHE_LINE)
+           , DCACHE_LINE);
+}
+REG_CMD(0, "IRQLINES", cmd_irqlines,
+        "IRQLINES [<features>]\n"
+        "  Show which cache lines of the wirq data the irq handler touches\n"
+        "  with the current IRQS, TRACES and MMUMergeCount settings.\n"
+        "  <features> is a mask of handler features (1=pxa, 2=polling,\n"
+        "  4=mmu merge, 8=WIRQRATE sampling) and defaults to all of them.")
+
+
 /****************************************************************
  * Binding of "chained" irq handler
  ****************************************************************/
@@ -335,6 +577,10 @@ struct irqAsmVars {
     uint32 winceAbortHandler;
     // Standard WinCE prefetch handler.
     uint32 wincePrefetchHandler;
+    // Modified Virtual Address of the C handler variants.
+    uint32 irqHandlerC;
+    uint32 abortHandlerC;
+    uint32 prefetchHandlerC;
 };
 
 extern "C" {
@@ -347,15 +593,86 @@ extern "C" {
     extern void irq_chained_handler();
     extern void abort_chained_handler();
     extern void prefetch_chained_handler();
+    extern void irq_count_handler();
+    extern void abort_count_handler();
+    extern void prefetch_count_handler();
 }
+// The counting only handlers in irqchain.S update the summary
+// counters at fixed offsets - fail the build if they move.
+#define BUILD_ASSERT(name, cond) typedef char name[(cond) ? 1 : -1]
+BUILD_ASSERT(irqCountOffset, offsetof(irqData, irqCount) == 0);
+BUILD_ASSERT(abortCountOffset, offsetof(irqData, abortCount) == 4);
+BUILD_ASSERT(prefetchCountOffset, offsetof(irqData, prefetchCount) == 8);
+
 #define offset_asmIrqVars() (&asmIrqVars - &irq_start)
 #define offset_asmIrqHandler() ((char *)irq_chained_handler - &irq_start)
 #define offset_asmAbortHandler() ((char *)abort_chained_handler - &irq_start)
 #define offset_asmPrefetchHandler() ((char *)prefetch_chained_handler - &irq_start)
 #define offset_cResumeHandler() ((char *)resume_handler - &irq_start)
+#define offset_irqCode(func) ((char *)(func) - &irq_start)
 #define size_cHandlers() (&irq_end - &irq_start)
 #define size_handlerCode() (uint)(&((irqChainCode*)0)->cCode[size_cHandlers()])
 
+static uint32 WirqGeneric;
+REG_VAR_INT(0, "WIRQGENERIC", WirqGeneric,
+            "Use the exception handlers that check for every feature"
+            " (for comparing handler cost)")
+
+// Select the exception handler variants that contain just the
+// features enabled for this session.  A handler with nothing to do
+// is replaced by one that only counts the exception.
+static void
+pickHandlers(irqChainCode *code, irqAsmVars *asmVars, uint32 *newIrqHandler
+             , uint32 *newAbortHandler, uint32 *newPrefetchHandler)
+{
+    struct irqData *data = &code->data;
+    int pxaTraps = data->isPXA && (data->dbcon
+                                   || data->insns[0].addr1 != 0xFFFFFFFF);
+    int irqF = 0, abortF = 0;
+    if (data->irqpoll.count || data->tracepoll.count)
+        irqF |= HF_POLL;
+    if (data->tracepoll.count)
+        abortF |= HF_POLL;
+    if (data->mergeTableCount) {
+        irqF |= HF_MERGE;
+        abortF |= HF_MERGE;
+    }
+    if (data->ostRegs)
+        irqF |= HF_SAMPLE;
+    if (data->alterCount)
+        abortF |= HF_L1;
+    if (WirqGeneric) {
+        irqF = abortF = HF_ALL;
+        if (!data->isPXA)
+            irqF = abortF = HF_ALL & ~HF_PXA;
+    } else if (data->isPXA) {
+        if (irqF || pxaTraps)
+            irqF |= HF_PXA;
+        if (abortF || pxaTraps)
+            abortF |= HF_PXA;
+    }
+
+    asmVars->irqHandlerC = (uint32)&code->cCode[
+        offset_irqCode(IrqHandlers[irqF])];
+    asmVars->abortHandlerC = (uint32)&code->cCode[
+        offset_irqCode(AbortHandlers[abortF])];
+    asmVars->prefetchHandlerC = (uint32)&code->cCode[
+        offset_irqCode(PrefetchHandlers[abortF])];
+    if (!irqF)
+        *newIrqHandler = (uint32)&code->cCode[
+            offset_irqCode(irq_count_handler)];
+    if (!abortF) {
+        *newAbortHandler = (uint32)&code->cCode[
+            offset_irqCode(abort_count_handler)];
+        *newPrefetchHandler = (uint32)&code->cCode[
+            offset_irqCode(prefetch_count_handler)];
+    }
+    Output("Handler features: irq=%x abort/prefetch=%x"
+           " (irq touches %d cache lines of data)", irqF, abortF
+           , countIrqLines(irqF, data->irqpoll.count, data->tracepoll.count
+                           , data->mergeTableCount, 0));
+}
+
 // Main "watch irq" command entry point.
 static void
 cmd_wirq(const char *cmd, const char *args)
@@ -365,6 +682,11 @@ cmd_wirq(const char *cmd, const char *args)
         ScriptError("Expected <seconds>");
         return;
     }
+    if (isBootStaged()) {
+        // The staged kernel owns the resume vector.
+        Output(C_ERROR "A kernel is staged - run UNSTAGEBOOT first");
+        return;
+    }
 
     // Locate position of wince exception handlers.
     uint32 *irq_loc = findWinCEirq(VADDR_IRQOFFSET);
@@ -378,16 +700,16 @@ cmd_wirq(const char *cmd, const char *args)
         return;
     uint32 newIrqHandler, newAbortHandler, newPrefetchHandler;
 
-    // Allocate space for the irq handlers in physically continuous ram.
-    struct continuousPageInfo *pageinfo;
+    // Allocate space for the irq handlers in physically continuous
+    // ram.  The block is cached between runs (see getContPool).
     int pagecount = PAGE_ALIGN(size_handlerCode()) / PAGE_SIZE;
-    irqChainCode *code = (irqChainCode *)allocContPages(pagecount, &pageinfo);
+    irqChainCode *code = (irqChainCode *)getContPool(pagecount);
     int ret;
     struct irqData *data = &code->data;
     struct irqAsmVars *asmVars = (irqAsmVars*)&code->cCode[offset_asmIrqVars()];
     if (!code) {
         Output(C_INFO "Can't allocate memory for irq code");
-        goto abort;
+        return;
     }
     memset(code, 0, size_handlerCode());
 
@@ -414,10 +736,17 @@ cmd_wirq(const char *cmd, const char *args)
 
     preLoop(data);
 
+    if (WirqPower && powerSampleStart(WirqPower))
+        goto abort;
+
     ret = prepPXAtraps(data);
     if (ret)
         goto abort;
 
+    ret = prepPXAsampler(data);
+    if (ret)
+        goto abort;
+
     ret = prepL1traps(data);
     if (ret)
         goto abort;
@@ -426,6 +755,9 @@ cmd_wirq(const char *cmd, const char *args)
     if (ret)
         goto abort;
 
+    pickHandlers(code, asmVars, &newIrqHandler, &newAbortHandler
+                 , &newPrefetchHandler);
+
     ret = hookResume(
         memVirtToPhys((uint32)&code->cCode[offset_cResumeHandler()])
         , memVirtToPhys((uint32)data)
@@ -444,6 +776,7 @@ cmd_wirq(const char *cmd, const char *args)
     *irq_loc = newIrqHandler;
     *abort_loc = newAbortHandler;
     *prefetch_loc = newPrefetchHandler;
+    startPXAsampler(data);
     return_control();
     Output("Finished installing exception handlers.");
 
@@ -453,6 +786,7 @@ cmd_wirq(const char *cmd, const char *args)
     // Restore wince handler.
     Output("Restoring windows exception handlers...");
     take_control();
+    stopPXAsampler(data);
     stopPXAtraps(data);
     stopL1traps(data);
     stopMMUMerge(data);
@@ -467,8 +801,10 @@ cmd_wirq(const char *cmd, const char *args)
 
     dumpMMUMerge(data);
     postLoop(data);
+    powerSampleFinish(WirqPowerFile);
 abort:
-    freeContPages(pageinfo);
+    powerSampleStop();
+    putContPool();
 }
 REG_CMD(0, "WI|RQ", cmd_wirq,
         "WIRQ <seconds>\n"
@@ -11,6 +11,7 @@
 #include "output.h" // Output
 #include "memory.h" // MMU_L1_UNMAPPED
 #include "arminsns.h" // getReg
+#include "tlhcmds.h" // modAnnotate
 #include "irq.h"
 
 #define ONEMEG (1024*1024)
@@ -144,8 +145,11 @@ report_memAccess(irqData *, const char *header, traceitem *item)
 {
     uint32 addr=item->d0, pc=item->d1, insn=item->d2, val=item->d3;
     uint32 changed=item->d4;
-    Output("%s mmutrace %08x: %08x(%s) %08x %08x (%08x)"
-           , header, pc, insn, getInsnName(insn), addr, val, changed);
+    char modbuf[64];
+    modAnnotate(modbuf, sizeof(modbuf), pc);
+    Output("%s mmutrace %08x: %08x(%s) %08x %08x (%08x)%s"
+           , header, pc, insn, getInsnName(insn), addr, val, changed
+           , modbuf);
 }
 
 // Event reporting
@@ -548,9 +552,16 @@ REG_VAR_INT(0, "PERMISSIVEMMUTRACE", PermissiveMMUtrace,
 static void
 alterTracePoint(struct irqData *data, memcheck *mc)
 {
-    for (uint i=0; i<data->alterCount; i++)
+    for (uint i=0; i<data->alterCount; i++) {
         if (addrmatch(data->alterVAddrs[i], mc->addr))
             mc->addr = newAddr(data, i) | (mc->addr & BOTBITS);
+        // A capture block can't cross a page, so checking its start
+        // is enough.
+        if (mc->captureCount
+            && addrmatch(data->alterVAddrs[i], mc->captureAddr))
+            mc->captureAddr = (newAddr(data, i)
+                               | (mc->captureAddr & BOTBITS));
+    }
 }
 
 // Prepare for memory tracing.
@@ -21,8 +21,11 @@
 #include "cpu.h" // take_control, return_control
 #include "video.h" // vidGetVRAM
 #include "machines.h" // Mach
+#include "arch-pxa.h" // testPXA
 #include "fbwrite.h" // fb_puts
 #include "winvectors.h" // stackJumper_s
+#include "lateload.h" // LATE_LOAD
+#include "pwindbas.h" // SetSystemPowerState
 #include "linboot.h"
 #include "resource.h"
 
@@ -47,6 +50,21 @@ REG_VAR_INT(0, "MTYPE", bootMachineType
 REG_VAR_INT(0, "FBDURINGBOOT", FBDuringBoot
             , "Enable/disable writing status lines to screen during boot")
 REG_VAR_INT(0, "KERNEL_OFFSET", kernelOffset, "Kernel text offset delta value")
+// Extra pages to pin while looking for the kernel/initrd destinations
+// (off by default - the extra pages stay pinned until the boot).
+static uint32 bootPlacePages = 0;
+REG_VAR_INT(0, "BOOTPLACEPAGES", bootPlacePages
+            , "Extra pages to pin looking for ram already at the kernel"
+              " and initrd destination (0 = don't pin extra pages)")
+// Move the initrd to where most of its pages already are
+static uint32 initrdPlace = 1;
+REG_VAR_INT(0, "INITRD_PLACE", initrdPlace
+            , "Place the initrd at the largest run of continuous pinned"
+              " pages (0 = fixed offset)")
+// Have the preloader copy the kernel/initrd with the caches on
+static uint32 cachedCopy = 0;
+REG_VAR_INT(0, "CACHEDCOPY", cachedCopy
+            , "Copy the kernel/initrd with the mmu and caches on")
 
 /*
  * Theory of operation:
@@ -92,10 +110,15 @@ REG_VAR_INT(0, "KERNEL_OFFSET", kernelOffset, "Kernel text offset delta value")
 #define PHYSOFFSET_TAGS   0x100
 // Recommended kernel placement = RAM start + kernelOffset + 32K
 #define PHYSOFFSET_KERNEL 0x8000
-// Initrd will be put at the address of kernel + 5MB
+// Initrd will be put at the address of kernel + 5MB (or higher - see
+// pickInitrdDest)
 #define PHYSOFFSET_INITRD (PHYSOFFSET_KERNEL + 0x500000)
 // Maximum size of the tags structure.
 #define TAGSIZE (PAGE_SIZE - 0x100)
+// Identity map used by CACHEDCOPY = RAM start + kernelOffset + 16K
+// (where the kernel will put its own page tables).
+#define PHYSOFFSET_TTB    0x4000
+#define TTBSIZE           0x4000
 
 /* Set up kernel parameters. ARM/Linux kernel uses a series of tags,
  * every tag describe some aspect of the machine it is booting on.
@@ -151,6 +174,22 @@ setup_linux_params(char *tagaddr, uint32 phys_initrd_addr, uint32 initrd_size)
 #define MAX_INDEX 6
 #define PAGES_PER_INDEX (PAGE_SIZE / sizeof(uint32))
 
+// Results of the hardware shutdown (see Machine::hardwareShutdown).
+// They are kept in the preloader data page so they can be found
+// after booting (the page address is shown when loading).
+#define BOOTTIMING_MAGIC 0x54544842 // "BHTT"
+struct bootTiming {
+    uint32 magic, clockKHz, totalTicks, count;
+    struct {
+        char name[8];
+        int32 id;
+        uint32 ticks, polls, finished;
+    } steps[MAX_QUIESCE];
+    // Pages copied by the preloader and the clock ticks it took
+    // (index 0 with the caches off, 1 with CACHEDCOPY).
+    uint32 copyPages[2], copyTicks[2];
+};
+
 // Data Shared between normal haret code and C preload code.
 struct preloadData {
     uint32 machtype;
@@ -159,7 +198,7 @@ struct preloadData {
     char *tags;
     uint32 kernelOffset;
     uint32 kernelSize;
-    uint32 initrdSize;
+    uint32 initrdAddr, initrdSize;
     const char **indexPages[MAX_INDEX];
 
     // Optional CRC check
@@ -170,6 +209,14 @@ struct preloadData {
     fbinfo fbi;
     uint32 physFB, physFonts;
     unsigned char fonts[FONTDATAMAX];
+
+    // Copy with the caches on using an identity map at 'ttb' (if set)
+    uint32 ttb, ramSize;
+    // Extra section descriptor bits (bit 4 on non-XScale v4/v5 cores)
+    uint32 sectionBits;
+    uint32 physClock, clockKHz;
+
+    struct bootTiming timing;
 };
 
 // CRC a block of ram (from linux/lib/crc32.c)
@@ -205,14 +252,22 @@ do_copy(char *dest, const char *src, int count)
         *d++ = *s++;
 }
 
-// Copy a list of pages to a linear area of memory
-static void __preload
+// Copy a list of pages to a linear area of memory.  Pages that are
+// already at their destination are skipped.  Returns the number of
+// pages copied.
+static int __preload
 do_copyPages(char *dest, const char ***pages, int start, int pagecount)
 {
+    int copied = 0;
     for (int i=start; i<start+pagecount; i++) {
-        do_copy(dest, pages[i/PAGES_PER_INDEX][i%PAGES_PER_INDEX], PAGE_SIZE);
+        const char *src = pages[i/PAGES_PER_INDEX][i%PAGES_PER_INDEX];
+        if (src != dest) {
+            do_copy(dest, src, PAGE_SIZE);
+            copied++;
+        }
         dest += PAGE_SIZE;
     }
+    return copied;
 }
 
 // Get Program Status Register value (in __preload section)
@@ -243,9 +298,164 @@ static inline int __preload
 fbOverlaps(struct preloadData *pd)
 {
     return IN_RANGE(pd->physFB, pd->startRam
-                    , PHYSOFFSET_INITRD + pd->kernelOffset + pd->initrdSize);
+                    , pd->initrdAddr + pd->initrdSize - pd->startRam);
+}
+
+// Unsigned divide (the preloader can't call into libgcc).
+static uint32 __preload
+do_udiv(uint32 n, uint32 d)
+{
+    uint32 q = 0, bit = 1;
+    if (!d)
+        return 0;
+    while (d < n && !(d & 0x80000000)) {
+        d <<= 1;
+        bit <<= 1;
+    }
+    for (; bit; d >>= 1, bit >>= 1) {
+        if (n >= d) {
+            n -= d;
+            q |= bit;
+        }
+    }
+    return q;
+}
+
+static inline uint32 __preload
+do_readClock(struct preloadData *data)
+{
+    if (!data->physClock)
+        return 0;
+    return *(volatile uint32 *)data->physClock;
+}
+
+// Copy 'count' pages of the kernel/initrd starting at page 'first'
+// and report the speed.
+static void __preload
+do_timedCopy(struct preloadData *data, int first, int count, int cached)
+{
+    char *destKernel = (char *)data->startRam + PHYSOFFSET_KERNEL + data->kernelOffset;
+    char *destInitrd = (char *)data->initrdAddr;
+    int kernelCount = PAGE_ALIGN(data->kernelSize) / PAGE_SIZE;
+
+    uint32 start = do_readClock(data);
+    int copied = 0;
+    if (first < kernelCount) {
+        int n = kernelCount - first;
+        if (n > count)
+            n = count;
+        copied += do_copyPages(destKernel + first * PAGE_SIZE
+                               , data->indexPages, first, n);
+        first += n;
+        count -= n;
+    }
+    if (count)
+        copied += do_copyPages(destInitrd + (first - kernelCount) * PAGE_SIZE
+                               , data->indexPages, first, count);
+    uint32 ticks = do_readClock(data) - start;
+    data->timing.copyPages[cached] += copied;
+    data->timing.copyTicks[cached] += ticks;
+
+    if (!data->clockKHz || !copied) {
+        FB_PRINTF(&data->fbi, "Copied %%d pages\\n", copied);
+        return;
+    }
+    // Time in 1/10ths of a millisecond.
+    uint32 t = do_udiv(ticks * 10, data->clockKHz);
+    if (!t)
+        t = 1;
+    uint32 kbps = do_udiv(copied * (PAGE_SIZE / 1024) * 10000, t);
+    if (cached)
+        FB_PRINTF(&data->fbi, "Copied %%d pages in %%d.%%d ms"
+                  " (%%d KB/s, caches on)\\n", copied, t / 10, t % 10, kbps);
+    else
+        FB_PRINTF(&data->fbi, "Copied %%d pages in %%d.%%d ms"
+                  " (%%d KB/s, caches off)\\n", copied, t / 10, t % 10, kbps);
+}
+
+// Build an identity mapped section table (ram cached, everything
+// else uncached) and turn on the mmu, D-cache and write buffer.
+static void __preload
+do_cacheOn(struct preloadData *data)
+{
+    uint32 *ttb = (uint32 *)data->ttb;
+    uint32 ramStart = data->startRam >> 20;
+    uint32 ramEnd = (data->startRam + data->ramSize - 1) >> 20;
+    uint32 fb = data->fbi.fb ? data->physFB >> 20 : 0xfffff;
+    for (uint32 i = 0; i < 4096; i++) {
+        uint32 desc = (i << 20) | 0xc02 | data->sectionBits; // section, r/w
+        // The framebuffer may be in ram - keep it uncached.
+        if (i >= ramStart && i <= ramEnd && i != fb && i != fb + 1)
+            desc |= 0x0c; // cached, bufferable
+        ttb[i] = desc;
+    }
+    asm volatile(
+        "mov r0, #0\n"
+        "mcr p15, 0, r0, c7, c7, 0\n"   // invalidate I+D caches
+        "mcr p15, 0, r0, c7, c10, 4\n"  // drain write buffer
+        "mcr p15, 0, r0, c8, c7, 0\n"   // invalidate TLBs
+        "mcr p15, 0, %0, c2, c0, 0\n"   // set ttb
+        "mvn r0, #0\n"
+        "mcr p15, 0, r0, c3, c0, 0\n"   // all domains manager
+        "mrc p15, 0, r0, c1, c0, 0\n"
+        "orr r0, r0, #0x000d\n"         // mmu, D-cache, write buffer
+        "orr r0, r0, #0x1000\n"         // I-cache
+        "mcr p15, 0, r0, c1, c0, 0\n"
+        "mrc p15, 0, r0, c2, c0, 0\n"   // wait for cp15 update
+        "mov r0, r0\n"
+        "sub pc, pc, #4\n"
+        : : "r" (ttb) : "r0", "memory");
+}
+
+// Write back the D-cache lines of an area.
+static void __preload
+do_cleanRange(const char *start, uint32 len)
+{
+    uint32 p = (uint32)start & ~31, end = (uint32)start + len;
+    for (; p < end; p += 32)
+        asm volatile("mcr p15, 0, %0, c7, c10, 1" : : "r" (p) : "memory");
 }
 
+// Write back the stack and data pages (the only other ram written
+// while cached) and turn the mmu and caches back off.  Nothing may
+// write to memory between the clean and the disable, so this is done
+// in one block.
+static void __preload
+do_cacheOff(struct preloadData *data)
+{
+    asm volatile(
+        "bic r0, sp, #0x0ff0\n"
+        "bic r0, r0, #0x000f\n"
+        "add r1, r0, #0x1000\n"
+        "1: mcr p15, 0, r0, c7, c10, 1\n" // clean stack page
+        "add r0, r0, #32\n"
+        "cmp r0, r1\n"
+        "blo 1b\n"
+        "mov r0, %0\n"
+        "add r1, r0, #0x1000\n"
+        "2: mcr p15, 0, r0, c7, c10, 1\n" // clean data page
+        "add r0, r0, #32\n"
+        "cmp r0, r1\n"
+        "blo 2b\n"
+        "mov r0, #0\n"
+        "mcr p15, 0, r0, c7, c10, 4\n"  // drain write buffer
+        "mrc p15, 0, r0, c1, c0, 0\n"
+        "bic r0, r0, #0x000d\n"         // mmu, D-cache, write buffer off
+        "bic r0, r0, #0x1000\n"         // I-cache off
+        "mcr p15, 0, r0, c1, c0, 0\n"
+        "mrc p15, 0, r0, c2, c0, 0\n"   // wait for cp15 update
+        "mov r0, r0\n"
+        "sub pc, pc, #4\n"
+        "mov r0, #0\n"
+        "mcr p15, 0, r0, c7, c7, 0\n"   // invalidate I+D caches
+        "mcr p15, 0, r0, c8, c7, 0\n"   // invalidate TLBs
+        : : "r" ((uint32)data & ~(PAGE_SIZE-1)) : "r0", "r1", "cc", "memory");
+}
+
+// Number of pages copied with the caches off for comparison when
+// CACHEDCOPY is set.
+#define COPY_SAMPLE 64
+
 // Code to launch kernel.
 static void __preload
 preloader(struct preloadData *data)
@@ -270,19 +480,28 @@ preloader(struct preloadData *data)
 
     FB_PRINTF(&data->fbi, "Tags relocated\\n");
 
-    // Copy kernel image
+    // Copy kernel and initrd (if applicable) images.  With CACHEDCOPY
+    // only a sample is copied with the caches off.
     char *destKernel = (char *)data->startRam + PHYSOFFSET_KERNEL + data->kernelOffset;
     int kernelCount = PAGE_ALIGN(data->kernelSize) / PAGE_SIZE;
-    do_copyPages((char *)destKernel, data->indexPages, 0, kernelCount);
-
-    FB_PRINTF(&data->fbi, "Kernel relocated\\n");
-
-    // Copy initrd (if applicable)
-    char *destInitrd = (char *)data->startRam + PHYSOFFSET_INITRD + data->kernelOffset;
+    char *destInitrd = (char *)data->initrdAddr;
     int initrdCount = PAGE_ALIGN(data->initrdSize) / PAGE_SIZE;
-    do_copyPages(destInitrd, data->indexPages, kernelCount, initrdCount);
+    int imageCount = kernelCount + initrdCount;
+    int uncachedCount = imageCount;
+    if (data->ttb && uncachedCount > COPY_SAMPLE)
+        uncachedCount = COPY_SAMPLE;
+    do_timedCopy(data, 0, uncachedCount, 0);
+    if (uncachedCount < imageCount) {
+        do_cacheOn(data);
+        do_timedCopy(data, uncachedCount, imageCount - uncachedCount, 1);
+        do_cleanRange(destKernel, kernelCount * PAGE_SIZE);
+        do_cleanRange(destInitrd, initrdCount * PAGE_SIZE);
+        do_cacheOff(data);
+    }
 
-    FB_PRINTF(&data->fbi, "Initrd relocated\\n");
+    FB_PRINTF(&data->fbi, "Kernel/initrd relocated (%%d of %%d pages copied)\\n"
+              , data->timing.copyPages[0] + data->timing.copyPages[1]
+              , imageCount);
 
     // Do CRC check (if enabled).
     if (data->doCRC) {
@@ -344,20 +563,160 @@ struct bootmem {
     char *tagsPage;
     uint32 physExec;
     uint32 pageCount;
-    void *allocedRam;
+    struct pageAddrs pages[PAGES_PER_INDEX * MAX_INDEX + 4];
     struct preloadData *pd;
 };
 
+// Pinned pages used for booting.  These are kept after a failed boot
+// attempt (or a resumeintoboot timeout) so that a retry doesn't need
+// to pin them again.
+static struct pageArena BootArena;
+
+// Kernel left loaded with the resume vector hooked (see STAGEBOOT).
+static struct bootmem *StagedBoot;
+
 // Release resources allocated in prepForKernel.
 static void
 cleanupBootMem(struct bootmem *bm)
 {
     if (!bm)
         return;
-    freePages(bm->allocedRam);
     free(bm);
 }
 
+static void
+cmd_freebootmem(const char *cmd, const char *args)
+{
+    unstageBoot();
+    if (BootArena.pageCount)
+        Output("Releasing %d pinned boot pages", BootArena.pageCount);
+    arenaFree(&BootArena);
+}
+REG_CMD(0, "FREEBOOTMEM", cmd_freebootmem,
+        "FREEBOOTMEM\n"
+        "  Release the ram kept pinned from a previous boot attempt.")
+
+// Does the page at 'relPhys' (offset from start of ram) overlap the
+// area [start, start+len)?
+static inline int
+pageOverlaps(uint32 relPhys, uint32 start, uint32 len)
+{
+    return relPhys < start + len && relPhys + PAGE_SIZE > start;
+}
+
+// Fill in the 'totalCount' boot pages (tags, kernel, initrd, index,
+// stack, data, preload) from a pool of pinned pages.  Pool pages that
+// are at the exact destination of a kernel/initrd page are used for
+// that page (the preloader doesn't need to copy them).  Other pages
+// the preloader will overwrite are not used at all.  Returns the
+// number of pages already in place, or -1 if the pool is too small.
+static int
+placeBootPages(struct pageAddrs *pool, int poolCount
+               , struct pageAddrs *pages, int totalCount
+               , uint32 kernelCount, uint32 initrdCount, uint32 initrdDest)
+{
+    uint32 tagsDest = PHYSOFFSET_TAGS + kernelOffset;
+    uint32 kernelDest = PHYSOFFSET_KERNEL + kernelOffset;
+    uint32 kernelLen = kernelCount * PAGE_SIZE;
+    uint32 initrdLen = initrdCount * PAGE_SIZE;
+
+    memset(pages, 0, totalCount * sizeof(pages[0]));
+    int inPlace = 0, next = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < poolCount; i++) {
+            struct pageAddrs *pg = &pool[i];
+            uint32 relPhys = pg->physLoc - memPhysAddr;
+            int slot = -1;
+            if (pageOverlaps(relPhys, kernelDest, kernelLen)) {
+                if (relPhys >= kernelDest
+                    && !((relPhys - kernelDest) % PAGE_SIZE))
+                    slot = 1 + (relPhys - kernelDest) / PAGE_SIZE;
+            } else if (pageOverlaps(relPhys, initrdDest, initrdLen)) {
+                if (relPhys >= initrdDest
+                    && !((relPhys - initrdDest) % PAGE_SIZE))
+                    slot = 1 + kernelCount + (relPhys - initrdDest) / PAGE_SIZE;
+            } else if (!pageOverlaps(relPhys, tagsDest, TAGSIZE)
+                       && !(cachedCopy && pageOverlaps(
+                                relPhys, PHYSOFFSET_TTB + kernelOffset
+                                , TTBSIZE))) {
+                // Page isn't touched by the preloader.
+                if (pass == 0)
+                    continue;
+                while (next < totalCount && pages[next].virtLoc)
+                    next++;
+                if (next >= totalCount)
+                    return inPlace;
+                pages[next] = *pg;
+                continue;
+            }
+            // Page will be overwritten - only usable in place.
+            if (pass == 0 && slot >= 0) {
+                pages[slot] = *pg;
+                inPlace++;
+            }
+        }
+    }
+    while (next < totalCount && pages[next].virtLoc)
+        next++;
+    if (next < totalCount)
+        return -1;
+    return inPlace;
+}
+
+static int
+physComp(const void *e1, const void *e2)
+{
+    uint32 p1 = *(uint32*)e1, p2 = *(uint32*)e2;
+    return p1 < p2 ? -1 : (p1 > p2 ? 1 : 0);
+}
+
+// Choose where the preloader puts the initrd (as an offset from the
+// start of ram).  The default spot leaves the kernel room to
+// decompress itself, so the initrd may only be moved higher.  With
+// INITRD_PLACE set, the start of the largest run of physically
+// continuous pool pages is used if more of the initrd is then
+// already in place.
+static uint32
+pickInitrdDest(struct pageAddrs *pool, int poolCount, uint32 initrdCount)
+{
+    uint32 minDest = PHYSOFFSET_INITRD + kernelOffset;
+    uint32 initrdLen = initrdCount * PAGE_SIZE;
+    if (!initrdPlace || !initrdCount)
+        return minDest;
+    uint32 *phys = (uint32*)malloc(poolCount * sizeof(phys[0]));
+    if (!phys)
+        return minDest;
+    int count = 0, defInPlace = 0;
+    for (int i = 0; i < poolCount; i++) {
+        uint32 relPhys = pool[i].physLoc - memPhysAddr;
+        if (relPhys < minDest || relPhys >= memPhysSize)
+            continue;
+        phys[count++] = relPhys;
+        if (relPhys < minDest + initrdLen)
+            defInPlace++;
+    }
+    qsort(phys, count, sizeof(phys[0]), physComp);
+
+    uint32 bestDest = minDest, bestRun = defInPlace;
+    for (int i = 0; i < count; ) {
+        int start = i++;
+        while (i < count && phys[i] == phys[i-1] + PAGE_SIZE)
+            i++;
+        uint32 run = i - start;
+        if (run > initrdCount)
+            run = initrdCount;
+        if (run > bestRun && phys[start] + initrdLen <= memPhysSize) {
+            bestRun = run;
+            bestDest = phys[start];
+        }
+    }
+    free(phys);
+    if (bestDest != minDest)
+        Output("Placing initrd at %08x (%d of %d pages continuous)"
+               , memPhysAddr + bestDest, bestRun, initrdCount);
+    return bestDest;
+}
+
 // Allocate memory for a kernel (and possibly initrd), and configure a
 // preloader that can launch that kernel.  Note the caller needs to
 // copy the kernel and initrd into the pages allocated.
@@ -370,6 +729,9 @@ prepForKernel(uint32 kernelSize, uint32 initrdSize)
         return NULL;
     }
 
+    // The pages of a staged kernel are about to be reused.
+    unstageBoot();
+
     // Determine machine type
     uint32 machType = bootMachineType;
     if (! machType)
@@ -382,6 +744,21 @@ prepForKernel(uint32 kernelSize, uint32 initrdSize)
         Output(C_ERROR "Please set start of ram (RAMADDR)");
         return NULL;
     }
+    // Make sure the images fit where the preloader will put them.
+    if (initrdSize
+        && kernelSize > PHYSOFFSET_INITRD - PHYSOFFSET_KERNEL) {
+        Output(C_ERROR "Kernel (%d bytes) would overlap initrd - largest"
+               " size is %d", kernelSize
+               , PHYSOFFSET_INITRD - PHYSOFFSET_KERNEL);
+        return NULL;
+    }
+    uint32 imageEnd = (initrdSize ? PHYSOFFSET_INITRD + initrdSize
+                       : PHYSOFFSET_KERNEL + kernelSize) + kernelOffset;
+    if (imageEnd > memPhysSize) {
+        Output(C_ERROR "Kernel/initrd (ending at %08x) don't fit in ram"
+               " (RAMSIZE=%08x)", imageEnd, memPhysSize);
+        return NULL;
+    }
     Output("boot params: RAMADDR=%08x RAMSIZE=%08x MTYPE=%d CMDLINE='%s'"
            , memPhysAddr, memPhysSize, machType, bootCmdline);
     Output("Boot FB feedback: %d", FBDuringBoot);
@@ -406,15 +783,44 @@ prepForKernel(uint32 kernelSize, uint32 initrdSize)
         return NULL;
     }
 
-    struct pageAddrs pages[PAGES_PER_INDEX * MAX_INDEX + 4];
-    bm->pageCount = totalCount;
-    bm->allocedRam = allocPages(pages, totalCount);
-    if (! bm->allocedRam) {
-	free(bm);
-	return NULL;
+    // Pin the boot pages.  If some of the kernel/initrd pages aren't
+    // already at their destination and BOOTPLACEPAGES is set, pin
+    // extra pages in the hope of finding them there.
+    struct pageAddrs *pages = bm->pages;
+    int imageCount = kernelCount + initrdCount;
+    if (arenaAlloc(&BootArena, totalCount)) {
+        free(bm);
+        return NULL;
     }
-
-    Output("Built virtual to physical page mapping");
+    uint32 initrdDest = pickInitrdDest(BootArena.pages, BootArena.pageCount
+                                       , initrdCount);
+    int inPlace = placeBootPages(BootArena.pages, BootArena.pageCount
+                                 , pages, totalCount, kernelCount, initrdCount
+                                 , initrdDest);
+    if ((inPlace < imageCount && bootPlacePages) || inPlace < 0) {
+        int maxCount = ARENA_MAX_CHUNKS * ARENA_CHUNK_PAGES;
+        int wantCount = totalCount + (bootPlacePages ? bootPlacePages
+                                      : ARENA_CHUNK_PAGES);
+        if (wantCount > maxCount)
+            wantCount = maxCount;
+        if (BootArena.pageCount < wantCount) {
+            // A failure here isn't fatal - use whatever got pinned.
+            arenaAlloc(&BootArena, wantCount);
+            initrdDest = pickInitrdDest(BootArena.pages, BootArena.pageCount
+                                        , initrdCount);
+            inPlace = placeBootPages(BootArena.pages, BootArena.pageCount
+                                     , pages, totalCount
+                                     , kernelCount, initrdCount, initrdDest);
+        }
+    }
+    if (inPlace < 0) {
+        Output(C_ERROR "Unable to allocate %d usable pages", totalCount);
+        free(bm);
+        return NULL;
+    }
+    bm->pageCount = totalCount;
+    Output("%d of %d kernel/initrd pages already in place (%d pages pinned)"
+           , inPlace, imageCount, BootArena.pageCount);
 
     struct pageAddrs *pg_tag = &pages[0];
     struct pageAddrs *pgs_kernel = &pages[1];
@@ -424,34 +830,6 @@ prepForKernel(uint32 kernelSize, uint32 initrdSize)
     struct pageAddrs *pg_data = &pages[totalCount-2];
     struct pageAddrs *pg_preload = &pages[totalCount-1];
 
-    // Prevent pages from being overwritten during relocation
-    for (int i=0; i<totalCount; i++) {
-        struct pageAddrs *pg = &pages[i], *ovpg;
-        uint32 relPhys = pg->physLoc - memPhysAddr;
-        // See if this page will be overwritten in preloader.
-        if (relPhys == 0)
-            ovpg = pg_tag;
-        else if (relPhys >= PHYSOFFSET_KERNEL + kernelOffset
-                 && relPhys < PHYSOFFSET_KERNEL + kernelOffset + kernelSize)
-            ovpg = &pgs_kernel[(relPhys - PHYSOFFSET_KERNEL - kernelOffset) / PAGE_SIZE];
-        else if (initrdSize
-                 && (relPhys >= PHYSOFFSET_INITRD + kernelOffset
-                     && relPhys < PHYSOFFSET_INITRD + kernelOffset + initrdSize))
-            ovpg = &pgs_initrd[(relPhys - PHYSOFFSET_INITRD - kernelOffset) / PAGE_SIZE];
-        else
-            // This page wont be overwritten.
-            continue;
-        if (pg == ovpg)
-            // This page will be overwritten by itself - no problem
-            continue;
-        // This page will be overwritten - swap it with the page that
-        // it will be overwritten by and retry.
-        struct pageAddrs tmp = *pg;
-        *pg = *ovpg;
-        *ovpg = tmp;
-        i--;
-    }
-
     Output("Allocated %d pages (tags=%p/%08x kernel=%p/%08x initrd=%p/%08x"
            " index=%p/%08x)"
            , totalCount
@@ -461,8 +839,8 @@ prepForKernel(uint32 kernelSize, uint32 initrdSize)
            , pgs_index->virtLoc, pgs_index->physLoc);
 
     // Setup linux tags.
-    setup_linux_params(pg_tag->virtLoc, memPhysAddr + PHYSOFFSET_INITRD
-                    + kernelOffset, initrdSize);
+    setup_linux_params(pg_tag->virtLoc, memPhysAddr + initrdDest
+                       , initrdSize);
     Output("Built kernel tags area");
 
     // Setup kernel/initrd indexes
@@ -478,15 +856,39 @@ prepForKernel(uint32 kernelSize, uint32 initrdSize)
 
     // Setup preloader data.
     struct preloadData *pd = (struct preloadData *)pg_data->virtLoc;
+    // The page may be left over from a previous attempt.
+    memset(pd, 0, sizeof(*pd));
     pd->machtype = machType;
     pd->tags = (char *)pg_tag->physLoc;
     pd->kernelOffset = kernelOffset;
     pd->kernelSize = kernelSize;
+    pd->initrdAddr = memPhysAddr + initrdDest;
     pd->initrdSize = initrdSize;
     for (int i=0; i<indexCount; i++)
         pd->indexPages[i] = (const char **)pgs_index[i].physLoc;
     pd->startRam = memPhysAddr;
+    if (cachedCopy) {
+        uint32 ttb = memPhysAddr + PHYSOFFSET_TTB + kernelOffset;
+        if (Mach->arm6mmu) {
+            // do_cacheOn only knows the ARMv4/v5 cp15 sequence.
+            Output(C_WARN "ARMv6 mmu - not using CACHEDCOPY");
+        } else if (ttb & (TTBSIZE-1)) {
+            Output(C_WARN "RAMADDR+KERNEL_OFFSET not 16K aligned"
+                   " - not using CACHEDCOPY");
+        } else {
+            pd->ttb = ttb;
+            pd->ramSize = memPhysSize;
+            // Bit 4 of a section descriptor must be one on ARMv4/v5
+            // cores other than XScale (which uses it for IMP/P).
+            pd->sectionBits = testPXA() ? 0 : 0x10;
+            Output("Cached copy using page table at %08x", ttb);
+        }
+    }
+    pd->physClock = Mach->clockPhys;
+    pd->clockKHz = Mach->clockKHz;
     bm->pd = pd;
+    Output("Boot timing page at %08x"
+           , pg_data->physLoc + offsetof(struct preloadData, timing));
 
     if (FBDuringBoot) {
         fb_init(&pd->fbi);
@@ -557,6 +959,24 @@ setupTrampoline()
     return physAddrTram;
 }
 
+// Copy the shutdown results to the boot timing page.
+static void
+saveBootTiming(struct bootTiming *bt)
+{
+    bt->magic = BOOTTIMING_MAGIC;
+    bt->clockKHz = Mach->clockKHz;
+    bt->totalTicks = Mach->quiesceTicks;
+    bt->count = Mach->quiesceCount;
+    for (int i=0; i<Mach->quiesceCount; i++) {
+        struct quiesceStep *qs = &Mach->quiesceSteps[i];
+        strncpy(bt->steps[i].name, qs->name, sizeof(bt->steps[i].name));
+        bt->steps[i].id = qs->id;
+        bt->steps[i].ticks = qs->ticks;
+        bt->steps[i].polls = qs->polls;
+        bt->steps[i].finished = qs->finished;
+    }
+}
+
 // Launch a kernel loaded in memory.
 static void
 launchKernel(struct bootmem *bm)
@@ -570,7 +990,8 @@ launchKernel(struct bootmem *bm)
     uint8 *virtAddrMmu = memPhysMap(cpuGetMMU());
     Output("MMU setup: mmu=%p/%08x", virtAddrMmu, cpuGetMMU());
 
-    // Call per-arch setup.
+    // Call per-arch setup (which also adds the device shutdown steps).
+    Mach->quiesceCount = 0;
     int ret = Mach->preHardwareShutdown();
     if (ret) {
         Output(C_ERROR "Setup for machine shutdown failed");
@@ -587,6 +1008,7 @@ launchKernel(struct bootmem *bm)
 
     // Call per-arch boot prep function.
     Mach->hardwareShutdown(&bm->pd->fbi);
+    saveBootTiming(&bm->pd->timing);
 
     fb_printf(&bm->pd->fbi, "Turning off MMU...\n");
 
@@ -598,6 +1020,98 @@ launchKernel(struct bootmem *bm)
 }
 
 
+/****************************************************************
+ * Image validation
+ ****************************************************************/
+
+// The images are checked before any memory is allocated for them, so
+// that a wrong file is reported immediately instead of after reading
+// it.
+
+static uint32 KernelCheck = 1;
+REG_VAR_INT(0, "KERNELCHECK", KernelCheck
+            , "Check that the kernel is a zImage before loading it"
+              " (set to 0 to boot other kernel images)")
+
+// zImage header (see linux/arch/arm/boot/compressed/head.S)
+#define ZIMAGE_MAGIC 0x016f2818
+#define ZIMAGE_HEADER_SIZE 0x30
+struct zimageHeader {
+    uint32 code[9];
+    uint32 magic;
+    uint32 start, end;
+};
+
+// Check a kernel header.  Returns non-zero if it is not a valid
+// kernel.  The whole file is always loaded - data after the end of
+// the zImage (eg, an appended device tree) belongs to the kernel.
+static int
+checkKernel(const char *hdr, uint32 hdrLen, uint32 fileSize)
+{
+    if (!fileSize) {
+        Output(C_ERROR "Kernel file is empty");
+        return -1;
+    }
+    if (!KernelCheck)
+        return 0;
+    struct zimageHeader zh;
+    if (hdrLen < sizeof(zh)) {
+        Output(C_ERROR "Kernel too small (%d bytes) to be a zImage", hdrLen);
+        return -1;
+    }
+    memcpy(&zh, hdr, sizeof(zh));
+    if (zh.magic != ZIMAGE_MAGIC) {
+        Output(C_ERROR "Kernel is not a zImage (magic %08x)."
+               "  Set KERNELCHECK to 0 to boot it anyway.", zh.magic);
+        return -1;
+    }
+    uint32 size = zh.end - zh.start;
+    if (zh.end <= zh.start || size > fileSize) {
+        Output(C_ERROR "Invalid zImage - header claims %d bytes, file has %d"
+               , size, fileSize);
+        return -1;
+    }
+    Output("zImage header okay (start=%08x end=%08x)", zh.start, zh.end);
+    if (size < fileSize)
+        Output("%d bytes appended after the zImage", fileSize - size);
+    return 0;
+}
+
+// Known initrd formats.
+static const struct {
+    uint32 offset, len;
+    const char *magic, *name;
+} InitrdTypes[] = {
+    { 0, 2, "\x1f\x8b", "gzip" },
+    { 0, 6, "070701", "cpio" },
+    { 0, 6, "\xfd" "7zXZ\x00", "xz" },
+    { 0, 3, "\x5d\x00\x00", "lzma" },
+    { 0, 3, "BZh", "bzip2" },
+    { 0, 4, "\x45\x3d\xcd\x28", "cramfs" },
+    { 0, 4, "hsqs", "squashfs" },
+    { 0x438, 2, "\x53\xef", "ext2" },
+};
+#define INITRD_HEADER_SIZE 0x440
+
+// Report the format of an initrd.  Unknown formats only get a
+// warning.
+static void
+checkInitrd(const char *hdr, uint32 hdrLen)
+{
+    for (uint32 i=0; i<ARRAY_SIZE(InitrdTypes); i++) {
+        uint32 end = InitrdTypes[i].offset + InitrdTypes[i].len;
+        if (end <= hdrLen && !memcmp(&hdr[InitrdTypes[i].offset]
+                                     , InitrdTypes[i].magic
+                                     , InitrdTypes[i].len)) {
+            Output("Initrd is %s data", InitrdTypes[i].name);
+            return;
+        }
+    }
+    // Linux accepts raw images of any filesystem it knows.
+    Output(C_WARN "Unknown initrd format - loading it anyway");
+}
+
+
 /****************************************************************
  * File reading
  ****************************************************************/
@@ -647,6 +1161,19 @@ file_read(FILE *f, char **pages, uint32 size)
     return 0;
 }
 
+// Read data at 'offset' from the current position of a file without
+// changing the position.  Returns the number of bytes read.
+static uint32
+file_peek(FILE *f, uint32 offset, char *buf, uint32 size)
+{
+    long pos = ftell(f);
+    if (fseek(f, pos + offset, SEEK_SET))
+        return 0;
+    uint32 ret = fread(buf, 1, size, f);
+    fseek(f, pos, SEEK_SET);
+    return ret;
+}
+
 
 // Load a kernel (and possibly initrd) from disk into ram and prep it
 // for kernel starting.
@@ -654,6 +1181,17 @@ file_read(FILE *f, char **pages, uint32 size)
 static bootmem *
 loadHandleKernel(FILE *fKernel, FILE *fInitrd, int kernelSize, int initrdSize)
 {
+    // Check the images before allocating anything for them.
+    char hdr[INITRD_HEADER_SIZE];
+    uint32 len = file_peek(fKernel, 0, hdr, ZIMAGE_HEADER_SIZE);
+    if (checkKernel(hdr, len, kernelSize))
+        return NULL;
+    if (initrdSize) {
+        len = file_peek(fInitrd, fInitrd == fKernel ? kernelSize : 0
+                        , hdr, sizeof(hdr));
+        checkInitrd(hdr, len);
+    }
+
     // Obtain ram for the kernel
     int ret;
     struct bootmem *bm = NULL;
@@ -703,9 +1241,17 @@ loadDiskKernel()
     uint32 initrdSize = 0;
     if (bootInitrd[0]) {
         initrdFile = file_open(bootInitrd);
-        if (!initrdFile)
+        if (!initrdFile) {
+            fclose(kernelFile);
             return NULL;
+        }
         initrdSize = get_file_size(initrdFile);
+        if (!initrdSize) {
+            Output(C_ERROR "Initrd file is empty");
+            fclose(kernelFile);
+            fclose(initrdFile);
+            return NULL;
+        }
     }
     
     struct bootmem *bm = loadHandleKernel(kernelFile, initrdFile, kernelSize, initrdSize);
@@ -744,6 +1290,89 @@ resumeIntoBoot(struct bootmem *bm)
     unhookResume();
 }
 
+// Hook the resume vector and leave the kernel loaded - the next
+// suspend/resume (at any time) boots it.
+static void
+stageBoot(struct bootmem *bm)
+{
+    int ret = hookResume(bm->physExec, 0, 0);
+    if (ret) {
+        Output("Failed to hook resume vector");
+        cleanupBootMem(bm);
+        return;
+    }
+    StagedBoot = bm;
+    Screen("Kernel staged.  Suspend/resume (or run SUSPENDBOOT) to boot.");
+}
+
+// Cancel a staged boot (the pages stay pinned for a later attempt).
+void
+unstageBoot()
+{
+    if (!StagedBoot)
+        return;
+    Output("Cancelling staged boot");
+    unhookResume();
+    cleanupBootMem(StagedBoot);
+    StagedBoot = NULL;
+}
+
+// Is a kernel waiting on the resume vector?
+int
+isBootStaged()
+{
+    return StagedBoot != NULL;
+}
+
+static void
+cmd_unstageboot(const char *cmd, const char *args)
+{
+    if (!StagedBoot) {
+        Output("No kernel staged");
+        return;
+    }
+    unstageBoot();
+}
+REG_CMD(0, "UNSTAGEBOOT", cmd_unstageboot,
+        "UNSTAGEBOOT\n"
+        "  Restore the resume vector hooked by STAGEBOOT.")
+
+// Devices without SetSystemPowerState (before CE 4.0) can be suspended
+// by sending the power off key.
+static DWORD
+alt_SetSystemPowerState(LPCWSTR state, DWORD flags, DWORD options)
+{
+    keybd_event(VK_OFF, 0, 0, 0);
+    keybd_event(VK_OFF, 0, KEYEVENTF_KEYUP, 0);
+    return 0;
+}
+
+LATE_LOAD_ALT(SetSystemPowerState, "coredll")
+
+static void
+cmd_suspendboot(const char *cmd, const char *args)
+{
+    if (!StagedBoot) {
+        Output(C_ERROR "No kernel staged - run STAGEBOOT first");
+        return;
+    }
+    Output("Suspending to boot staged kernel");
+    DWORD ret = late_SetSystemPowerState(NULL, POWER_STATE_SUSPEND
+                                         , POWER_FORCE);
+    if (ret) {
+        Output(C_ERROR "SetSystemPowerState failed (%d)", ret);
+        return;
+    }
+    // The request may complete before the suspend happens.
+    Sleep(2000);
+    if (StagedBoot)
+        Output(C_WARN "Still running - resume vector remains hooked");
+}
+REG_CMD(0, "SUSPENDBOOT", cmd_suspendboot,
+        "SUSPENDBOOT\n"
+        "  Suspend the pda now so that the kernel staged with STAGEBOOT\n"
+        "  boots on resume.")
+
 
 /****************************************************************
  * Boot code
@@ -768,9 +1397,9 @@ crc_pages(char **pages, uint32 origsize)
     return crc32_be_finish(crc, origsize);
 }
 
-// Boot a kernel loaded into memory via one of two mechanisms.
+// Boot a kernel loaded into memory via one of the BOOT_XXX mechanisms.
 static void
-tryLaunch(struct bootmem *bm, int bootViaResume)
+tryLaunch(struct bootmem *bm, int bootMode)
 {
     // Setup CRC (if enabled).
     if (KernelCRC) {
@@ -784,7 +1413,12 @@ tryLaunch(struct bootmem *bm, int bootViaResume)
     }
 
     Output("Launching to physical address %08x", bm->physExec);
-    if (bootViaResume)
+    if (bootMode == BOOT_STAGED) {
+        // Kept until booted or unstaged.
+        stageBoot(bm);
+        return;
+    }
+    if (bootMode == BOOT_RESUME)
         resumeIntoBoot(bm);
     else
         launchKernel(bm);
@@ -797,7 +1431,11 @@ tryLaunch(struct bootmem *bm, int bootViaResume)
 static void
 bootLinux(const char *cmd, const char *args)
 {
-    int bootViaResume = toupper(cmd[0]) == 'R';
+    int bootMode = BOOT_NOW;
+    if (toupper(cmd[0]) == 'R')
+        bootMode = BOOT_RESUME;
+    else if (toupper(cmd[0]) == 'S')
+        bootMode = BOOT_STAGED;
 
     // Load the kernel/initrd/tags/preloader into memory
     struct bootmem *bm = loadDiskKernel();
@@ -805,7 +1443,7 @@ bootLinux(const char *cmd, const char *args)
         return;
 
     // Launch it.
-    tryLaunch(bm, bootViaResume);
+    tryLaunch(bm, bootMode);
 }
 REG_CMD(0, "BOOT|LINUX", bootLinux,
         "BOOTLINUX\n"
@@ -816,6 +1454,12 @@ REG_CMD_ALT(
     "RESUMEINTOBOOT\n"
     "  Overwrite the wince resume vector so that the kernel boots\n"
     "  after suspending/resuming the pda")
+REG_CMD_ALT(
+    0, "STAGEBOOT", bootLinux, stageboot,
+    "STAGEBOOT\n"
+    "  Load the kernel and overwrite the wince resume vector, but\n"
+    "  return immediately.  The kernel boots on the next resume (see\n"
+    "  SUSPENDBOOT) until UNSTAGEBOOT is run.")
 
 
 /****************************************************************
@@ -840,8 +1484,14 @@ copy_pages(char **pages, const char *src, uint32 size)
 void
 bootRamLinux(const char *kernel, uint32 kernelSize
              , const char *initrd, uint32 initrdSize
-             , int bootViaResume)
+             , int bootMode)
 {
+    // Check the images before allocating anything for them.
+    if (checkKernel(kernel, kernelSize, kernelSize))
+        return;
+    if (initrdSize)
+        checkInitrd(initrd, initrdSize);
+
     // Obtain ram for the kernel
     struct bootmem *bm = prepForKernel(kernelSize, initrdSize);
     if (!bm)
@@ -854,11 +1504,11 @@ bootRamLinux(const char *kernel, uint32 kernelSize
     DoneProgress();
 
     // Launch it.
-    tryLaunch(bm, bootViaResume);
+    tryLaunch(bm, bootMode);
 }
 
 void
-bootHandleLinux(FILE *f, int kernelSize, int initrdSize, int bootViaResume)
+bootHandleLinux(FILE *f, int kernelSize, int initrdSize, int bootMode)
 {
     // Load the kernel/initrd/tags/preloader into memory
     struct bootmem *bm = loadHandleKernel(f, f, kernelSize, initrdSize);
@@ -866,5 +1516,5 @@ bootHandleLinux(FILE *f, int kernelSize, int initrdSize, int bootViaResume)
         return;
 
     // Launch it.
-    tryLaunch(bm, bootViaResume);
+    tryLaunch(bm, bootMode);
 }
@@ -24,6 +24,17 @@ MachineIMX21::init()
 		// IRQs
 		"addlist IRQS p2v(0x10040048) 0 32 0\n"
 		"addlist IRQS p2v(0x1004004c) 0 32 0\n"
+		// Register blocks for regsnap
+		"addregblock GPIO 0x10015000 0x600\n"
+		"addregblock AITC 0x10040000 0x68\n"
+		"addregblock EIM 0xdf001000 0x30\n"
+		// Gpio banks for wgpio (sample status registers)
+		"addgpiobank SSR 0x10015024 1 1 0\n"
+		"addgpiobank SSR 0x10015124 1 1 32\n"
+		"addgpiobank SSR 0x10015224 1 1 64\n"
+		"addgpiobank SSR 0x10015324 1 1 96\n"
+		"addgpiobank SSR 0x10015424 1 1 128\n"
+		"addgpiobank SSR 0x10015524 1 1 160\n"
 	);
 }
 
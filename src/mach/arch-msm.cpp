@@ -25,6 +25,13 @@ defineMsmGpios()
         "addlist gpios p2v(0xa9200814)\n"
         "addlist gpios p2v(0xa9200818)\n"
         "addlist gpios p2v(0xa920081c)\n"
+        // Register blocks for regsnap
+        "addregblock GPIO1 0xa9200800 0x44\n"
+        "addregblock GPIO2 0xa9300c00 0x24\n"
+        // Gpio banks for wgpio (the "in" registers above)
+        "addgpiobank GPIN 0xa9200834 1 1 0\n"
+        "addgpiobank GPIN 0xa9300c20 1 1 32\n"
+        "addgpiobank GPIN 0xa9200838 3 1 64\n"
         );
 }
 
@@ -32,23 +32,37 @@
 #define OMAP_DMA_CCR_EN			(1 << 7)
 
 static void
-omapResetDMA(volatile uint8 *base, int chancount)
+omapStopDMA(void *data, int i)
 {
+    volatile uint8 *base = (uint8 *)data;
     uint16 status;
-    for (int i = 0; i < chancount; i++) {
-        /* Disable all DMA interrupts for the channel. */
-        OMAP_DMA_CICR_REG(i) = 0;
 
-        /* Set the STOP_LNK bit */
-        OMAP_DMA_CLNK_CTRL_REG(i) |= 1 << 14;
+    /* Disable all DMA interrupts for the channel. */
+    OMAP_DMA_CICR_REG(i) = 0;
 
-        /* Make sure the DMA transfer is stopped. */
-        OMAP_DMA_CCR_REG(i) = 0;
-        OMAP_DMA_CCR_REG(i) &= ~OMAP_DMA_CCR_EN;
+    /* Set the STOP_LNK bit */
+    OMAP_DMA_CLNK_CTRL_REG(i) |= 1 << 14;
 
-        /* Clear pending interrupts */
-        status = OMAP_DMA_CSR_REG(i);
-    }
+    /* Make sure the DMA transfer is stopped. */
+    OMAP_DMA_CCR_REG(i) = 0;
+    OMAP_DMA_CCR_REG(i) &= ~OMAP_DMA_CCR_EN;
+
+    /* Clear pending interrupts */
+    status = OMAP_DMA_CSR_REG(i);
+}
+
+static int
+omapDMAStopped(void *data, int i)
+{
+    volatile uint8 *base = (uint8 *)data;
+    return (OMAP_DMA_CCR_REG(i) & OMAP_DMA_CCR_EN) == 0;
+}
+
+static void
+omapAddDMA(Machine *m, uint8 *base, int chancount)
+{
+    for (int i = 0; i < chancount; i++)
+        m->addQuiesce("dma", i, omapStopDMA, omapDMAStopped, base);
 }
 
 
@@ -76,8 +90,9 @@ omapResetDMA(volatile uint8 *base, int chancount)
 #define OMAP_IH2_ISR            __REG32(OMAP_IH2_BASE + 0x9c)
 
 static void
-omapResetIRQ(volatile uint8 *base)
+omapResetIRQ(void *data, int id)
 {
+        volatile uint8 *base = (uint8 *)data;
         OMAP_IH1_MIR = 0xFFFFFFFF;
         OMAP_IH1_ITR = 0;
         OMAP_IH1_CONTROL = 0x03;
@@ -141,6 +156,20 @@ initOmap(void)
         "addlist gpios P2V(0xfffbd810)\n"
         "addlist gpios P2V(0xfffbe010)\n"
         "addlist gpios P2V(0xfffbe810)\n"
+        // Register blocks for regsnap
+        "addregblock GPIO1 0xfffbc000 0x1c\n"
+        "addregblock GPIO2 0xfffbc800 0x1c\n"
+        "addregblock GPIO3 0xfffbd000 0x1c\n"
+        "addregblock GPIO4 0xfffbd800 0x1c\n"
+        "addregblock GPIO5 0xfffbe000 0x1c\n"
+        "addregblock GPIO6 0xfffbe800 0x1c\n"
+        // Gpio banks for wgpio (DATA_INPUT)
+        "addgpiobank GPIO 0xfffbc000 1 1 0\n"
+        "addgpiobank GPIO 0xfffbc800 1 1 32\n"
+        "addgpiobank GPIO 0xfffbd000 1 1 64\n"
+        "addgpiobank GPIO 0xfffbd800 1 1 96\n"
+        "addgpiobank GPIO 0xfffbe000 1 1 128\n"
+        "addgpiobank GPIO 0xfffbe800 1 1 160\n"
         );
 }
 
@@ -194,15 +223,10 @@ MachineOMAP850::preHardwareShutdown()
     base = memPhysMap(OMAP_BASE);
     if (! base)
         return -1;
+    omapAddDMA(this, base, 17);
     return 0;
 }
 
-void
-MachineOMAP850::hardwareShutdown(struct fbinfo *fbi)
-{
-    omapResetDMA(base, 17);
-}
-
 REGMACHINE(MachineOMAP850)
 
 
@@ -231,14 +255,9 @@ MachineOMAP15xx::preHardwareShutdown()
     base = memPhysMap(OMAP_BASE);
     if (! base)
         return -1;
+    addQuiesce("irq", 0, omapResetIRQ, NULL, base);
+    omapAddDMA(this, base, 8);
     return 0;
 }
 
-void
-MachineOMAP15xx::hardwareShutdown(struct fbinfo *fbi)
-{
-    omapResetIRQ(base);
-    omapResetDMA(base, 8);
-}
-
 REGMACHINE(MachineOMAP15xx)
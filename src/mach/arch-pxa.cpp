@@ -17,6 +17,9 @@ MachinePXA::MachinePXA()
     archname = "PXA";
     dcsr_count = 16;
     flushCache = cpuFlushCache_xscale;
+    // OSCR runs at 3.6864Mhz
+    clockKHz = 3686;
+    clockPhys = 0x40A00010;
 }
 
 DEF_GETCPR(get_p15r0, p15, 0, c0, c0, 0)
@@ -55,45 +58,60 @@ MachinePXA::init()
                  "addlist GPIOS p2v(0x40E0005c)\n"
                  "addlist GPIOS p2v(0x40E00060)\n"
                  "addlist GPIOS p2v(0x40E00064)\n"
-                 "addlist GPIOS p2v(0x40E00068)\n");
+                 "addlist GPIOS p2v(0x40E00068)\n"
+                 // Register blocks for regsnap
+                 "addregblock ICU 0x40D00000 0x14\n"
+                 "addregblock GPIO 0x40E00000 0x6c\n"
+                 "addregblock CLOCK 0x41300000 0x0c\n"
+                 "addregblock MEMC 0x48000000 0x48\n"
+                 // Gpio banks for wgpio
+                 "addgpiobank GPLR 0x40E00000 3\n"
+                 "addgpiobank GPDR 0x40E0000C 3\n"
+                 "addgpiobank GAFR 0x40E00054 6 2\n");
 }
 
-int
-MachinePXA::preHardwareShutdown()
+// Set a DMA channel to the stop state.
+static void
+pxaStopDMA(void *data, int chan)
 {
-    /* Map now everything we'll need later */
-    dma = (uint32 *)memPhysMap(DMA_BASE_ADDR);
-    udc = (uint32 *)memPhysMap(UDC_BASE_ADDR);
-    if (! dma || ! udc)
-        return -1;
-    return 0;
+    volatile pxaDMA *dma = (pxaDMA*)data;
+    dma->DCSR[chan] = DCSR_NODESC | DCSR_ENDINTR | DCSR_STARTINTR | DCSR_BUSERR;
 }
 
-static void
-pxaResetDMA(volatile pxaDMA *dma, int chancount)
+static int
+pxaDMAStopped(void *data, int chan)
 {
-    // Set DMAs to Stop state
-    for (int i = 0; i < chancount; i++)
-        dma->DCSR[i] = DCSR_NODESC | DCSR_ENDINTR | DCSR_STARTINTR | DCSR_BUSERR;
-
-    // Wait for DMAs to complete
-    for (int i = 0; i < chancount; i++) {
-	int timeout = 100000;
-        while ((dma->DCSR[i] & DCSR_STOPSTATE) == 0 && timeout--) ;
-    }
+    volatile pxaDMA *dma = (pxaDMA*)data;
+    return dma->DCSR[chan] & DCSR_STOPSTATE;
 }
 
 static void
-pxaResetUDC(volatile pxaUDC *udc)
+pxaResetUDC(void *data, int id)
 {
+    volatile pxaUDC *udc = (pxaUDC*)data;
     udc->_UDCCR = 0;
 }
 
-void
-MachinePXA::hardwareShutdown(struct fbinfo *fbi)
+int
+MachinePXA::preHardwareShutdown()
 {
-    pxaResetDMA((pxaDMA*)dma, dcsr_count);
-    pxaResetUDC((pxaUDC*)udc);
+    /* Map now everything we'll need later */
+    dma = (uint32 *)memPhysMap(DMA_BASE_ADDR);
+    udc = (uint32 *)memPhysMap(UDC_BASE_ADDR);
+    oscr = (uint32 *)memPhysMap(0x40A00010);
+    if (! dma || ! udc || ! oscr)
+        return -1;
+
+    for (uint32 i = 0; i < dcsr_count; i++)
+        addQuiesce("dma", i, pxaStopDMA, pxaDMAStopped, dma);
+    addQuiesce("udc", 0, pxaResetUDC, NULL, udc);
+    return 0;
+}
+
+uint32
+MachinePXA::readClock()
+{
+    return *(volatile uint32 *)oscr;
 }
 
 // Returns true if the current machine was found to be PXA based.
@@ -103,4 +121,11 @@ testPXA()
     return strncmp(Mach->archname, "PXA", 3) == 0;
 }
 
+// Returns true if the current machine is PXA27x based.
+int
+testPXA27x()
+{
+    return strcmp(Mach->archname, "PXA27x") == 0;
+}
+
 REGMACHINE(MachinePXA)
@@ -12,6 +12,8 @@ MachinePXA27x::MachinePXA27x()
     name = "Generic Intel PXA27x";
     archname = "PXA27x";
     dcsr_count = 32;
+    // OSCR0 runs at 3.25Mhz
+    clockKHz = 3250;
 }
 
 int
@@ -62,36 +64,34 @@ MachinePXA27x::init()
         "addlist CLOCKS p2v(0x4130000C)\n" // CCSR
         "addlist CLOCKS cp 14 0 6 0 0\n" // CLKCFG
         "addlist CLOCKS cp 14 0 7 0 0\n" // PWRMODE
+        // Register blocks for regsnap
+        "addregblock ICU 0x40D00000 0xb0\n"
+        "addregblock GPIO 0x40E00000 0x150\n"
+        "addregblock PWRMAN 0x40F00000 0x38\n"
+        "addregblock CLOCK 0x41300000 0x10\n"
+        "addregblock MEMC 0x48000000 0x68\n"
+        // Gpio banks for wgpio
+        "addgpiobank GPLR 0x40E00000 3\n"
+        "addgpiobank GPLR 0x40E00100 1 1 96\n"
+        "addgpiobank GPDR 0x40E0000C 3\n"
+        "addgpiobank GPDR 0x40E0010C 1 1 96\n"
+        "addgpiobank GAFR 0x40E00054 8 2\n"
         );
 }
 
-int
-MachinePXA27x::preHardwareShutdown()
-{
-    int ret = MachinePXA::preHardwareShutdown();
-    if (ret)
-        return ret;
-    cken = (uint32 *)memPhysMap(CKEN);
-    uhccoms = (uint32 *)memPhysMap(UHCCOMS);
-    if (! cken || ! uhccoms)
-        return -1;
-    return 0;
-}
-
 // disable USB host.
 static void
-Reset27xUHC(volatile uint32 *uhccoms)
+Reset27xUHC(void *data, int id)
 {
     // Reset usb host
-    *uhccoms=1;
+    *(volatile uint32 *)data=1;
 }
 
-void
-MachinePXA27x::hardwareShutdown(struct fbinfo *fbi)
+// Turn off the clocks of devices linux will reinitialize.
+static void
+Disable27xClocks(void *data, int id)
 {
-    MachinePXA::hardwareShutdown(fbi);
-    Reset27xUHC(uhccoms);
-
+    volatile uint32 *cken = (uint32 *)data;
     *cken=(*cken)&(~(
 //    CKEN5_STUART|
 //    CKEN6_FFUART|
@@ -106,4 +106,19 @@ MachinePXA27x::hardwareShutdown(struct fbinfo *fbi)
                        ));
 }
 
+int
+MachinePXA27x::preHardwareShutdown()
+{
+    int ret = MachinePXA::preHardwareShutdown();
+    if (ret)
+        return ret;
+    cken = (uint32 *)memPhysMap(CKEN);
+    uhccoms = (uint32 *)memPhysMap(UHCCOMS);
+    if (! cken || ! uhccoms)
+        return -1;
+    addQuiesce("uhc", 0, Reset27xUHC, NULL, uhccoms);
+    addQuiesce("cken", 0, Disable27xClocks, NULL, cken);
+    return 0;
+}
+
 REGMACHINE(MachinePXA27x)
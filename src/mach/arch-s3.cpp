@@ -49,6 +49,21 @@ MachineS3c2442::init()
         "addlist CLOCKS p2v(0x4C000010)\n" // CLKSLOW
         "addlist CLOCKS p2v(0x4C000014)\n" // CLKDIVN
         "addlist CLOCKS p2v(0x4C000018)\n" // CAMDIVN
+        // Register blocks for regsnap
+        "addregblock MEMC 0x48000000 0x34\n"
+        "addregblock IRQ 0x4A000000 0x20\n"
+        "addregblock CLOCK 0x4C000000 0x1c\n"
+        "addregblock GPIO 0x56000000 0xe0\n"
+        // Gpio banks for wgpio (data registers of ports A-H and J)
+        "addgpiobank GPA 0x56000004 1 1 0\n"
+        "addgpiobank GPB 0x56000014 1 1 32\n"
+        "addgpiobank GPC 0x56000024 1 1 64\n"
+        "addgpiobank GPD 0x56000034 1 1 96\n"
+        "addgpiobank GPE 0x56000044 1 1 128\n"
+        "addgpiobank GPF 0x56000054 1 1 160\n"
+        "addgpiobank GPG 0x56000064 1 1 192\n"
+        "addgpiobank GPH 0x56000074 1 1 224\n"
+        "addgpiobank GPJ 0x560000d4 1 1 256\n"
         );
 }
 
@@ -62,57 +77,41 @@ static inline void s3c_writel(volatile uint32 *base, uint32 reg, uint32 val)
     base[(reg/4)] = val;
 }
 
-int
-MachineS3c2442::preHardwareShutdown()
+// Stop a DMA channel (if it is running).
+static void
+s3c24xxStopDMA(void *data, int dma_ch)
 {
-    channels = (uint32*)memPhysMap(S3C2410_PA_DMA);
-    uhcmap = (uint32 *)memPhysMap(S3C2410_PA_USBHOST);
-    if (! channels || ! uhcmap)
-        return -1;
-    return 0;
+    volatile uint32 *ch = (uint32*)data + ((0x40 / 4) * dma_ch);
+    uint32 dmasktrig = s3c_readl(ch, S3C2410_DMA_DMASKTRIG);
+    if (dmasktrig & S3C2410_DMASKTRIG_ON)
+        s3c_writel(ch, S3C2410_DMA_DMASKTRIG, S3C2410_DMASKTRIG_STOP);
 }
 
-static void
-s3c24xxShutdownDMA(volatile uint32 *channels)
+static int
+s3c24xxDMAStopped(void *data, int dma_ch)
 {
-    int dma_ch;
-    volatile uint32 *ch;
-    uint32 dmasktrig;
-    int timeo;
-
-    for (dma_ch = 0; dma_ch < 4; dma_ch++) {
-        ch = channels + ((0x40 / 4) * dma_ch);
-
-        dmasktrig = s3c_readl(ch, S3C2410_DMA_DMASKTRIG);
-        if (dmasktrig & S3C2410_DMASKTRIG_ON) {
-            s3c_writel(ch, S3C2410_DMA_DMASKTRIG, S3C2410_DMASKTRIG_STOP);
-
-            timeo = 0x100000;
-            while (timeo > 0) {
-                dmasktrig = s3c_readl(ch, S3C2410_DMA_DMASKTRIG);
-
-                if ((dmasktrig & S3C2410_DMASKTRIG_ON) == 0)
-                    break;
-
-                if (timeo-- <= 0)
-                    break;
-            }
-        }
-    }
+    volatile uint32 *ch = (uint32*)data + ((0x40 / 4) * dma_ch);
+    return (s3c_readl(ch, S3C2410_DMA_DMASKTRIG) & S3C2410_DMASKTRIG_ON) == 0;
 }
 
 // Reset USB host.
 static void
-ResetUHC(volatile uint32 *uhcmap)
+ResetUHC(void *data, int id)
 {
-    uhcmap[2] = 1;
+    ((volatile uint32 *)data)[2] = 1;
 }
 
-void
-MachineS3c2442::hardwareShutdown(struct fbinfo *fbi)
+int
+MachineS3c2442::preHardwareShutdown()
 {
-    s3c24xxShutdownDMA(channels);
-    ResetUHC(uhcmap);
+    channels = (uint32*)memPhysMap(S3C2410_PA_DMA);
+    uhcmap = (uint32 *)memPhysMap(S3C2410_PA_USBHOST);
+    if (! channels || ! uhcmap)
+        return -1;
+    for (int i = 0; i < 4; i++)
+        addQuiesce("dma", i, s3c24xxStopDMA, s3c24xxDMAStopped, channels);
+    addQuiesce("uhc", 0, ResetUHC, NULL, uhcmap);
+    return 0;
 }
 
 REGMACHINE(MachineS3c2442)
@@ -42,6 +42,15 @@ MachineSA::init()
         // GPIO alt function (GAFR)
         "addlist GPIOS p2v(0x9004001C)\n"
 
+        // Register blocks for regsnap
+        "addregblock GPIO 0x90040000 0x20\n"
+        "addregblock ICU 0x90050000 0x14\n"
+
+        // Gpio banks for wgpio
+        "addgpiobank GPLR 0x90040000 1\n"
+        "addgpiobank GPDR 0x90040004 1\n"
+        "addgpiobank GAFR 0x9004001C 1\n"
+
         );
 }
 
@@ -4,6 +4,7 @@
 #include "script.h" // REG_VAR_ROFUNC
 #include "output.h" // Output
 #include "exceptions.h" // TRY_EXCEPTION_HANDLER
+#include "fbwrite.h" // fb_printf
 #include "machines.h"
 
 // Global current machine setting.
@@ -22,6 +23,7 @@ extern "C" {
 Machine::Machine()
     : name("Default"), archname("generic"), PlatformType(L"PocketPC")
     , machType(0), arm6mmu(0), flushCache(cpuFlushCache)
+    , quiesceCount(0), quiesceTicks(0), clockKHz(0), clockPhys(0)
 {
     memset(OEMInfo, 0, sizeof(OEMInfo));
 }
@@ -37,9 +39,94 @@ Machine::preHardwareShutdown()
     return 0;
 }
 
+uint32
+Machine::readClock()
+{
+    return 0;
+}
+
+
+/****************************************************************
+ * Device quiesce
+ ****************************************************************/
+
+// Number of polling rounds before giving up on a device.
+#define QUIESCE_ROUNDS 100000
+
+void
+Machine::addQuiesce(const char *name, int id
+                    , void (*start)(void *data, int id)
+                    , int (*done)(void *data, int id), void *data)
+{
+    if (quiesceCount >= MAX_QUIESCE) {
+        Output(C_ERROR "Too many shutdown steps - ignoring %s", name);
+        return;
+    }
+    quiesceStep *qs = &quiesceSteps[quiesceCount++];
+    qs->name = name;
+    qs->id = id;
+    qs->start = start;
+    qs->done = done;
+    qs->data = data;
+}
+
+// Convert clock ticks to microseconds.
+static uint32
+ticksToUS(uint32 ticks, uint32 khz)
+{
+    return (uint64)ticks * 1000 / khz;
+}
+
+// Run the steps added with addQuiesce().  This is called with
+// interrupts disabled, so results can only go to the framebuffer (the
+// boot code saves them to the boot timing page).
 void
 Machine::hardwareShutdown(struct fbinfo *fbi)
 {
+    uint32 start = readClock();
+    int pending = 0;
+    for (int i=0; i<quiesceCount; i++) {
+        quiesceStep *qs = &quiesceSteps[i];
+        qs->polls = qs->ticks = 0;
+        qs->finished = !qs->done;
+        pending += !qs->finished;
+        if (qs->start)
+            qs->start(qs->data, qs->id);
+    }
+    for (int round=0; pending && round<QUIESCE_ROUNDS; round++) {
+        for (int i=0; i<quiesceCount; i++) {
+            quiesceStep *qs = &quiesceSteps[i];
+            if (qs->finished)
+                continue;
+            qs->polls++;
+            if (qs->done(qs->data, qs->id)) {
+                qs->ticks = readClock() - start;
+                qs->finished = 1;
+                pending--;
+            }
+        }
+    }
+    quiesceTicks = readClock() - start;
+
+    // Only steps that had to wait are shown.
+    for (int i=0; i<quiesceCount; i++) {
+        quiesceStep *qs = &quiesceSteps[i];
+        if (!qs->done || qs->polls <= 1)
+            continue;
+        if (!qs->finished)
+            fb_printf(fbi, "%s%d: TIMEOUT\n", qs->name, qs->id);
+        else if (clockKHz)
+            fb_printf(fbi, "%s%d: %d polls %dus\n", qs->name, qs->id
+                      , qs->polls, ticksToUS(qs->ticks, clockKHz));
+        else
+            fb_printf(fbi, "%s%d: %d polls\n", qs->name, qs->id, qs->polls);
+    }
+    if (clockKHz)
+        fb_printf(fbi, "Stopped %d devices (%d timeouts) in %dus\n"
+                  , quiesceCount, pending, ticksToUS(quiesceTicks, clockKHz));
+    else
+        fb_printf(fbi, "Stopped %d devices (%d timeouts)\n"
+                  , quiesceCount, pending);
 }
 
 int
@@ -4,6 +4,7 @@
 //
 //  For conditions of use see file COPYING
 
+#include <windows.h> // GetTickCount
 #include <ctype.h> // toupper
 #include <stdio.h> // FILE
 
@@ -14,6 +15,8 @@
 #include "exceptions.h" // TRY_EXCEPTION_HANDLER
 #include "resource.h" // DLG_PROGRESS
 #include "machines.h" // Mach
+#include "regnames.h" // regDumpRange
+#include "memtest.h" // MemtestPatterns
 #include "memcmds.h"
 
 
@@ -72,15 +75,36 @@ memDump(uint8 *vaddr, uint32 size, uint32 base = (uint32)-1)
     if (base == (uint32)-1)
         base = (uint32)vaddr;
 
+    uint32 runEnd = 0;
+    int mapped = 1, lineOpen = 0;
     while (offs < size) {
+        if (offs >= runEnd)
+            runEnd = offs + memVirtRun((uint32)vaddr + offs, size - offs
+                                       , &mapped);
+
         if ((offs & 15) == 0) {
-            if (offs)
+            if (lineOpen)
                 Output(" | %s", chrdump);
+            lineOpen = 0;
+            if (!mapped && runEnd - offs >= 16) {
+                // Skip over whole lines of an unmapped area.
+                uint32 skip = (runEnd - offs) & ~15;
+                Output("%08x - %08x unmapped", base + offs
+                       , base + offs + skip - 1);
+                offs += skip;
+                continue;
+            }
             Output("%08x |\t", base + offs);
+            lineOpen = 1;
         }
 
-        uint32 d = memRead(vaddr + offs, MO_SIZE32);
-        Output(" %08x\t", d);
+        uint32 d = 0;
+        if (mapped) {
+            d = memRead(vaddr + offs, MO_SIZE32);
+            Output(" %08x\t", d);
+        } else {
+            Output(" --------\t");
+        }
 
         chrdump[(offs & 15) + 0] = dump_char((d      ) & 0xff);
         chrdump[(offs & 15) + 1] = dump_char((d >>  8) & 0xff);
@@ -90,6 +114,9 @@ memDump(uint8 *vaddr, uint32 size, uint32 base = (uint32)-1)
         offs += 4;
     }
 
+    if (!lineOpen)
+        return;
+
     while (offs & 15) {
         Output("         \t");
         chrdump[offs & 15] = 0;
@@ -102,15 +129,21 @@ memDump(uint8 *vaddr, uint32 size, uint32 base = (uint32)-1)
 // Dump a portion of physical memory to file
 static void memPhysDump(uint32 paddr, uint32 size)
 {
+    uint32 start = paddr, total = size;
     while (size) {
-        uint8 *vaddr = memPhysMap(paddr);
-        uint32 bytes = PHYS_CACHE_SIZE - (PHYS_CACHE_MASK & (uint32)vaddr);
-        if (bytes > size)
-            bytes = size;
+        uint32 bytes = size;
+        int cached;
+        uint8 *vaddr = memPhysMapRead(paddr, &bytes, &cached);
+        if (!vaddr) {
+            Output(C_ERROR "Unable to map %08x", paddr);
+            return;
+        }
         memDump(vaddr, bytes, paddr);
+        memPhysReadDone(vaddr, bytes, cached);
         size -= bytes;
         paddr += bytes;
     }
+    regDumpRange(start, total);
 }
 
 static void
@@ -236,46 +269,86 @@ REG_CMD(0, "PFW", cmd_memfill,
  * Dumping memory directly to file
  ****************************************************************/
 
+// Size of the buffer used when writing memory to a file.
+#define MEMWRITE_CHUNK 0x10000
+
+// Write virtual memory to a file.  Unmapped areas are written as
+// zeros (see safe_copy).
 static bool memWrite (FILE *f, uint32 addr, uint32 size)
 {
+  uint8 *buf = (uint8*)malloc(MEMWRITE_CHUNK);
+  if (!buf)
+  {
+    Output(C_ERROR "Unable to allocate write buffer");
+    return false;
+  }
+
+  bool ret = true;
   while (size)
   {
-    uint32 wc, sz = (size > 0x1000) ? 0x1000 : size;
-    TRY_EXCEPTION_HANDLER
+    uint32 sz = (size > MEMWRITE_CHUNK) ? MEMWRITE_CHUNK : size;
+    int mapped;
+    uint32 run = memVirtRun (addr, size, &mapped);
+    if (!mapped && run >= sz)
     {
-      wc = fwrite ((void *)addr, 1, sz, f);
+      // Large hole - report it once and write zeros for it.
+      Output("Skipped unmapped %08x-%08x", addr, addr + run - 1);
+      memset (buf, 0, sz);
+      sz = run;
+      for (uint32 left = run; left; )
+      {
+        uint32 cnt = (left > MEMWRITE_CHUNK) ? MEMWRITE_CHUNK : left;
+        if (fwrite (buf, 1, cnt, f) != cnt)
+        {
+          ret = false;
+          break;
+        }
+        left -= cnt;
+      }
     }
-    CATCH_EXCEPTION_HANDLER
+    else
     {
-      wc = 0;
-      Output(C_ERROR "Exception caught!");
+      safe_copy (buf, addr, sz);
+      if (fwrite (buf, 1, sz, f) != sz)
+        ret = false;
     }
 
-    if (wc != sz)
+    if (!ret)
     {
       Output(C_ERROR "Short write detected while writing to file");
-      fclose (f);
-      return false;
+      break;
     }
     addr += sz;
     size -= sz;
   }
-  return true;
+  free (buf);
+  return ret;
 }
 
 // Write a portion of physical memory to file
 static bool memPhysWriteFile (FILE *f, uint32 addr, uint32 size)
 {
+  uint32 start = GetTickCount (), total = size;
+  int anyCached = 0;
   while (size)
   {
-    uint8 *vaddr = memPhysMap (addr);
-    // We are guaranteed to have 32K ahead
-    uint32 sz = size > 0x8000 ? 0x8000 : size;
-    if (!memWrite (f, (uint32)vaddr, sz))
+    uint32 sz = size;
+    int cached;
+    uint8 *vaddr = memPhysMapRead (addr, &sz, &cached);
+    if (!vaddr)
+    {
+      Output(C_ERROR "Unable to map %08x", addr);
       return false;
+    }
+    bool ret = memWrite (f, (uint32)vaddr, sz);
+    memPhysReadDone (vaddr, sz, cached);
+    if (!ret)
+      return false;
+    anyCached |= cached;
     size -= sz;
     addr += sz;
   }
+  reportSpeed ("Wrote", total, GetTickCount () - start, anyCached);
   return true;
 }
 
@@ -481,6 +554,169 @@ REG_CMD(0, "ALLOCTEST", allocTest,
         "  virtual and physical addresses.")
 
 
+/****************************************************************
+ * Ram test
+ ****************************************************************/
+
+// Free ram (in bytes) that MEMTEST leaves to wince.
+static uint32 MemtestReserve = 2*1024*1024;
+REG_VAR_INT(0, "MEMTESTRESERVE", MemtestReserve,
+            "Bytes of free ram MEMTEST leaves for wince")
+
+#define MEMTEST_MAXERRORS 32
+
+struct memtestInfo {
+    struct pageArena *arena;
+    int chunk;
+    uint32 reported;
+};
+
+// Report a bad word by its physical address.
+static void
+memtestError(void *data, uint32 offset, uint32 expect, uint32 got)
+{
+    struct memtestInfo *mi = (struct memtestInfo*)data;
+    if (mi->reported++ >= MEMTEST_MAXERRORS)
+        return;
+    struct pageAddrs *pg = &mi->arena->pages[
+        mi->chunk * ARENA_CHUNK_PAGES + offset / PAGE_SIZE];
+    Output(C_ERROR "Ram error at %08x (virt %08x): wrote %08x read %08x"
+           , pg->physLoc + offset % PAGE_SIZE
+           , (uint32)pg->virtLoc + offset % PAGE_SIZE, expect, got);
+}
+
+// Pin free pages (in ARENA_CHUNK_PAGES chunks) until only
+// MemtestReserve bytes are left.  An arena holds at most
+// ARENA_MAX_CHUNKS chunks, so a new one is started whenever the last
+// fills up.  Returns the number of arenas stored in *parenas.
+static int
+memtestPin(struct pageArena **parenas)
+{
+    struct pageArena *arenas = NULL;
+    int count = 0;
+    for (;;) {
+        MEMORYSTATUS mst;
+        mst.dwLength = sizeof(mst);
+        GlobalMemoryStatus(&mst);
+        if (mst.dwAvailPhys < MemtestReserve + ARENA_CHUNK_PAGES * PAGE_SIZE)
+            break;
+        if (!count || arenas[count-1].chunkCount >= ARENA_MAX_CHUNKS) {
+            struct pageArena *na = (struct pageArena *)realloc(
+                arenas, (count + 1) * sizeof(arenas[0]));
+            if (!na)
+                break;
+            arenas = na;
+            memset(&arenas[count], 0, sizeof(arenas[0]));
+            arenas[count].pages = (struct pageAddrs *)calloc(
+                ARENA_MAX_CHUNKS * ARENA_CHUNK_PAGES, sizeof(struct pageAddrs));
+            if (!arenas[count].pages) {
+                Output(C_WARN "Failed to allocate page list");
+                break;
+            }
+            count++;
+        }
+        struct pageArena *pa = &arenas[count-1];
+        void *data = allocPages(&pa->pages[pa->pageCount], ARENA_CHUNK_PAGES);
+        if (!data)
+            break;
+        pa->chunks[pa->chunkCount++] = data;
+        pa->pageCount += ARENA_CHUNK_PAGES;
+    }
+    *parenas = arenas;
+    return count;
+}
+
+static void
+memtestUnpin(struct pageArena *arenas, int count)
+{
+    for (int i = 0; i < count; i++)
+        arenaFree(&arenas[i]);
+    free(arenas);
+}
+
+static void
+cmd_memtest(const char *cmd, const char *args)
+{
+    uint32 passes = 1, mask = (1 << MemtestPatternCount) - 1;
+    get_expression(&args, &passes);
+    get_expression(&args, &mask);
+
+    struct pageArena *arenas;
+    int arenaCount = memtestPin(&arenas);
+    int chunkCount = 0;
+    for (int a = 0; a < arenaCount; a++)
+        chunkCount += arenas[a].chunkCount;
+    if (!chunkCount) {
+        Output(C_ERROR "No free pages to test");
+        memtestUnpin(arenas, arenaCount);
+        return;
+    }
+    uint32 chunkSize = ARENA_CHUNK_PAGES * PAGE_SIZE;
+    Output("Testing %d KB of ram in %d chunks", chunkCount * (chunkSize / 1024)
+           , chunkCount);
+
+    struct memtestInfo mi;
+    memset(&mi, 0, sizeof(mi));
+    // The cache is flushed between writing and verifying so the
+    // checks read ram and not the cache.
+    struct memtestOps ops;
+    ops.sync = Mach->flushCache;
+    ops.error = memtestError;
+    ops.data = &mi;
+    ops.errors = 0;
+
+    int selected = 0;
+    for (int t = 0; t < MemtestPatternCount; t++)
+        if (mask & (1 << t))
+            selected++;
+    InitProgress(DLG_PROGRESS, passes * selected * chunkCount
+                 * (chunkSize / 1024));
+    uint64 bytes = 0;
+    uint32 start = GetTickCount();
+    for (uint32 pass = 0; pass < passes; pass++) {
+        uint32 seed = GetTickCount();
+        for (int t = 0; t < MemtestPatternCount; t++) {
+            const struct memtestPattern *mp = &MemtestPatterns[t];
+            if (!(mask & (1 << t)))
+                continue;
+            uint32 errors = ops.errors, tstart = GetTickCount();
+            for (int a = 0; a < arenaCount; a++) {
+                mi.arena = &arenas[a];
+                for (mi.chunk = 0; mi.chunk < mi.arena->chunkCount; mi.chunk++) {
+                    AddProgress(chunkSize / 1024);
+                    uint32 *buf = (uint32*)mi.arena->chunks[mi.chunk];
+                    mp->run(buf, chunkSize / sizeof(uint32), (uint32)buf
+                            , seed + a * ARENA_MAX_CHUNKS + mi.chunk, &ops);
+                }
+            }
+            uint64 tbytes = (uint64)chunkCount * chunkSize * mp->accesses;
+            bytes += tbytes;
+            Output("Pass %d %-8s %d errors (%d KB/s)", pass, mp->name
+                   , ops.errors - errors
+                   , (uint32)(tbytes * 1000 / 1024
+                              / (GetTickCount() - tstart + 1)));
+        }
+    }
+    DoneProgress();
+    uint32 msec = GetTickCount() - start;
+    Output("Tested %d MB of accesses in %d ms (%d KB/s)"
+           , (uint32)(bytes / (1024*1024)), msec
+           , (uint32)(bytes * 1000 / 1024 / (msec + 1)));
+    if (ops.errors)
+        Output(C_ERROR "%d bad words found (%d reported)", ops.errors
+               , mi.reported < MEMTEST_MAXERRORS ? mi.reported : MEMTEST_MAXERRORS);
+    else
+        Output("No errors found");
+    memtestUnpin(arenas, arenaCount);
+}
+REG_CMD(0, "MEMTEST", cmd_memtest,
+        "MEMTEST [<passes> [<mask>]]\n"
+        "  Test all free ram (less MEMTESTRESERVE) with walking bit,\n"
+        "  address, random and march patterns.  <mask> selects the\n"
+        "  patterns (bit 0 = walk, 1 = address, 2 = random, 3 = march).\n"
+        "  Bad words are reported by physical address.")
+
+
 /****************************************************************
  * Memory access variables
  ****************************************************************/
@@ -68,19 +68,12 @@ mem_autodetect()
  * Mapping physical memory
  ****************************************************************/
 
-#if 1
-
 /**
  * This version of memPhysMap sometimes locks up because of VirtualFree()
- * I don't know what's the real case, but I had to write a different
- * implementation using low-level operations instead of this one.
- * The second implementation, however, locks up on program exit
- * (haven't figured out why) so you have to choose between the two
- * implementations depending on your needs :-)
+ * I don't know what's the real case.  See memPhysMap_l1win below for
+ * an implementation that writes the mmu descriptors directly instead.
  */
 
-// The amount of physical memory locations to cache
-#define PHYS_CACHE_COUNT 8
 // Cache several last mapped physical memory for better effectivity
 static uint8 *phys_mem [PHYS_CACHE_COUNT];
 // The physical address (multiple of 32K, if 1 then slot is free)
@@ -153,8 +146,8 @@ uint8 *memPhysMap_wm(uint32 paddr)
   return phys_mem [0] + offs;
 }
 
-// Free the virtual memory pointers cache used by memPhysMap
-void memPhysReset ()
+// Free the virtual memory pointers cache used by memPhysMap_wm
+static void memPhysReset_wm ()
 {
   for (int i = 0; i < PHYS_CACHE_COUNT; i++)
     if (phys_mem [i])
@@ -165,210 +158,6 @@ void memPhysReset ()
     }
 }
 
-#else
-
-// The amount of physical memory locations to cache
-#define PHYS_CACHE_COUNT 8
-// The size of physical memory to map at once
-#define PHYS_CACHE_SIZE 0x10000
-#define PHYS_CACHE_MASK (PHYS_CACHE_SIZE - 1)
-
-static bool pmInited = false;
-// The window in virtual address space we use to map physical memory into
-static void *pmWindow;
-// The first address inside the pmWindow block which is 64K aligned
-static uint32 pmAlignedWindow;
-// Old contents of 2nd level page table
-static uint32 pmOldPT [PHYS_CACHE_COUNT * 16];
-// The 2nd level page table (4*16 entries)
-static uint32 *pmL2PT, *pmPT;
-// The LRU table for allocated cache entries
-static uint32 pmLRU [PHYS_CACHE_COUNT];
-// The domain used by Windows for VirtualCopy'ed pages
-static uint32 pmDomain;
-// The virtual address where the entire physical RAM is mapped
-static uint32 pmMemoryMapAddr = 0;
-
-uint8 *memPhysMap_bruteforce(uint32 paddr)
-{
-  if (!pmInited)
-  {
-    // At initialization we grab a virtual memory window of (n+1)*64K size.
-    // This address space is used to map into it (by direct writes into
-    // the L1 descriptor table - duh) the requested physical memory.
-    // We cannot guarantee the allocated window starts at a multiple of
-    // 64K address, however, since we request more than we need we can
-    // just ignore the unaligned space at the start of block.
-    pmWindow = VirtualAlloc (NULL, (PHYS_CACHE_COUNT + 1) * 64 * 1024,
-                             MEM_RESERVE, PAGE_READWRITE);
-    // Map anything to it (doesnt matter what)
-    if (!VirtualCopy (pmWindow, (void *)0, (PHYS_CACHE_COUNT + 1) * 64 * 1024,
-                      PAGE_READWRITE | PAGE_PHYSICAL | PAGE_NOCACHE))
-    {
-      Output(C_ERROR "Failed (%d) to map a dummy memory area to virtual address window",
-                GetLastError ());
-err:  VirtualFree (pmWindow, 0, MEM_RELEASE);
-      return NULL;
-    }
-
-    pmAlignedWindow = (PHYS_CACHE_MASK + (uint32)pmWindow) & ~PHYS_CACHE_MASK;
-    // The offset inside the MMU L1 descriptor table
-    uint32 pmBase = pmAlignedWindow & 0xfff00000;
-    // Apply current process ID register, if applicable
-    pmBase = MVAddr(pmBase);
-
-    //--- Read the L1 descriptor ---//
-
-    uint32 *l1desc = (uint32 *)VirtualAlloc (NULL, 4 * 4096, MEM_RESERVE, PAGE_READONLY);
-    if (!VirtualCopy (l1desc, (void *)(cpuGetMMU () >> 8), 4 * 4096,
-                      PAGE_READONLY | PAGE_PHYSICAL | PAGE_NOCACHE))
-    {
-      Output(C_ERROR "VirtualCopy() failed (%d) when accessing MMU L1 table",
-                GetLastError ());
-      VirtualFree (l1desc, 0, MEM_RELEASE);
-      goto err;
-    }
-
-#if 1
-    /* Interestingly enough, WinCE have set up a memory area (at virtual
-       address 0xa4000000 in my case) which maps the ENTIRE physical memory
-       in read-write mode for system programs (inaccessible for user programs).
-       But!!! it seems that WinCE (at least PPC 2003) runs all programs in
-       SYSTEM mode (!!! security? what's that ???). So we can try to
-       look the address of that area, and if we find it, we can keep
-       ourselves from doing a lot of extra work. */
-    if ((cpuGetPSR () & 0x1f) == 0x1f)
-    {
-      for (uint i = 0; i < 4096; i++)
-        if ((l1desc [i] & (MMU_L1_SECTION_MASK | MMU_L1_TYPE_MASK)) ==
-            (memPhysAddr | MMU_L1_SECTION))
-        {
-          bool ok = true;
-          for (uint j = 1024 * 1024; j < memPhysSize; j += 1024 * 1024)
-            if ((l1desc [i + (j >> 20)] & (MMU_L1_SECTION_MASK | MMU_L1_TYPE_MASK)) !=
-                ((memPhysAddr + j) | MMU_L1_SECTION))
-            {
-              ok = false;
-              break;
-            }
-          if (ok)
-          {
-            pmMemoryMapAddr = i << 20;
-            break;
-          }
-        }
-    }
-#endif
-
-    uint32 l2pt = l1desc [pmBase >> 20];
-    VirtualFree (l1desc, 0, MEM_RELEASE);
-
-    if ((l2pt & MMU_L1_TYPE_MASK) != MMU_L1_COARSE_L2)
-    {
-      Output(C_ERROR "Ooops... 2nd level table is not coarse. This is not implemented so far");
-      goto err;
-    }
-
-    // Now find the address of our entries in the 2nd level coarse page table
-    l2pt &= MMU_L1_COARSE_MASK;
-
-    // VirtualCopy will fail if l2pt is not on a 4K boundary
-    uint32 delta = l2pt & 0xfff;
-    l2pt &= 0xfffff000;
-
-    pmL2PT = (uint32 *)VirtualAlloc (NULL, 8192, MEM_RESERVE, PAGE_READWRITE);
-    if (!VirtualCopy (pmL2PT, (void *)(l2pt >> 8), 8192,
-                      PAGE_READWRITE | PAGE_PHYSICAL))
-    {
-      Output(C_ERROR "VirtualCopy() failed (%d) when accessing MMU L2 table",
-                GetLastError ());
-      VirtualFree (pmL2PT, 0, MEM_RELEASE);
-      goto err;
-    }
-
-    pmPT = pmL2PT + (delta >> 2) + ((pmAlignedWindow & 0xff000) >> 12);
-
-    // Remember the page table entries
-    int i;
-    for (i = 0; i < 16 * PHYS_CACHE_COUNT; i++)
-      pmOldPT [i] = pmPT [i];
-    // Compute the correct domain for our mappings
-    pmDomain = pmPT [0] & (MMU_L2_AP0_MASK | MMU_L2_AP1_MASK |
-                           MMU_L2_AP2_MASK | MMU_L2_AP3_MASK);
-
-    for (i = 0; i < PHYS_CACHE_COUNT; i++)
-      pmLRU [i] = i;
-
-    pmInited = true;
-  }
-
-  if (pmMemoryMapAddr
-   && (paddr >= memPhysAddr)
-   && (paddr < memPhysAddr + memPhysSize))
-    return (uint8 *)(paddr - memPhysAddr + pmMemoryMapAddr);
-
-  uint32 base = paddr & ~(PHYS_CACHE_MASK >> 1);
-  uint32 offs = paddr & (PHYS_CACHE_MASK >> 1);
-
-  // Check if the requested address is already mapped
-  int slot;
-  for (slot = 0; slot < PHYS_CACHE_COUNT; slot++)
-    if ((pmPT [pmLRU [slot] * 16] & (MMU_L2_TYPE_MASK | MMU_L2_SMALL_MASK)) ==
-        (MMU_L2_SMALLPAGE | base))
-      break;
-
-  if (slot >= PHYS_CACHE_COUNT)
-  {
-    // Go into supervisor mode
-    SetKMode (TRUE);
-    cli ();
-    cpuFlushCache ();
-
-    // Fill the least recently used slot with the new values
-    slot = PHYS_CACHE_COUNT - 1;
-    unsigned x = pmLRU [slot] * 16;
-    // Non-cacheable, non-bufferable
-    for (int i = 0; i < 16; i++)
-      pmPT [x + i] = MMU_L2_SMALLPAGE | pmDomain | (base + i * 4096);
-
-    // Back to user mode
-    sti ();
-    SetKMode (FALSE);
-  }
-
-  // Move least recently used slot to front
-  if (slot)
-  {
-    uint32 x = pmLRU [slot];
-    for (; slot > 0; slot--)
-      pmLRU [slot] = pmLRU [slot - 1];
-    pmLRU [0] = x;
-  }
-
-  return (uint8 *)(pmAlignedWindow + pmLRU [0] * PHYS_CACHE_SIZE + offs);
-}
-
-// Free the virtual memory pointers cache used by memPhysMap
-void memPhysReset ()
-{
-  if (pmInited)
-  {
-    // Go into supervisor mode
-    SetKMode (TRUE);
-    cpuFlushCache ();
-    // Restore the page table entries
-    for (int i = 0; i < 16 * PHYS_CACHE_COUNT; i++)
-      pmPT [i] = pmOldPT [i];
-    SetKMode (FALSE);
-
-    VirtualFree (pmL2PT, 0, MEM_RELEASE);
-    VirtualFree (pmWindow, 0, MEM_RELEASE);
-    pmInited = false;
-  }
-}
-
-#endif
-
 // Pointer to a virtual address mapping of the MMU table
 static uint32 *MMUTable;
 
@@ -482,9 +271,214 @@ memPhysMap_section(uint32 paddr, int cached=0)
     return (uint8*)((((uint32)m[base]) << 20) | (paddr & ((1<<20) - 1)));
 }
 
+
+/****************************************************************
+ * Mapping physical memory via a window of L1 descriptors
+ ****************************************************************/
+
+// A window of virtual address space is reserved and physical memory
+// is mapped into it by writing 1meg section descriptors into the L1
+// table directly.  A remap then costs a couple of uncached writes and
+// a tlb flush instead of a VirtualFree/VirtualAlloc/VirtualCopy.
+//
+// Each slot maps two consecutive sections so that there is always
+// (at least) 1meg available after the requested address.
+
+#define L1WIN_SLOTS 8
+#define L1WIN_SLOTSECTIONS 2
+#define L1WIN_SECTIONS (L1WIN_SLOTS * L1WIN_SLOTSECTIONS)
+#define SECTION_SIZE (1<<20)
+
+static void *L1WinAlloc;
+static uint8 *L1Window;
+// Index of the first window section in the MMU table
+static uint32 L1WinIndex;
+// Descriptors found in the window before it was taken over
+static uint32 L1WinOld[L1WIN_SECTIONS];
+// Physical section mapped by each slot (1 if unused) and its LRU age
+static uint32 L1WinBase[L1WIN_SLOTS], L1WinAge[L1WIN_SLOTS], L1WinClock;
+// Descriptor bits (access permissions, domain) used for the mappings
+static uint32 L1WinFlags;
+static int L1WinFailed;
+
+DEF_SETCPR(cpuInvalidateTLB, p15, 0, c8, c7, 0)
+DEF_SETCPR(cpuDrainWriteBuffer, p15, 0, c7, c10, 4)
+
+// Disable interrupts for a short descriptor update.  (take_control()
+// also flushes the log which is too slow to do on every remap.)
+static inline uint32
+irqSave()
+{
+    uint32 flags, temp;
+    asm volatile("mrs %0, cpsr\n"
+                 "      orr %1, %0, #0xc0\n"
+                 "      msr cpsr_c, %1"
+                 : "=r" (flags), "=r" (temp) : : "memory");
+    return flags;
+}
+static inline void
+irqRestore(uint32 flags)
+{
+    asm volatile("msr cpsr_c, %0" : : "r" (flags) : "memory");
+}
+
+// Write window descriptors and make sure the MMU sees them.
+static void
+l1winWrite(uint32 index, const uint32 *descs, uint32 count)
+{
+    uint32 flags = irqSave();
+    for (uint32 i=0; i<count; i++)
+        MMUTable[index + i] = descs[i];
+    cpuDrainWriteBuffer(0);
+    cpuInvalidateTLB(0);
+    irqRestore(flags);
+}
+
+static void
+l1winRelease()
+{
+    VirtualFree(L1WinAlloc, 0, MEM_RELEASE);
+    L1WinAlloc = NULL;
+    L1Window = NULL;
+}
+
+// Check the window is free and that the cp15 operations are permitted.
+static int
+l1winCheck()
+{
+    for (uint32 i=0; i<L1WIN_SECTIONS; i++) {
+        L1WinOld[i] = MMUTable[L1WinIndex + i];
+        if ((L1WinOld[i] & MMU_L1_TYPE_MASK) == MMU_L1_SECTION) {
+            Output(C_ERROR "L1 window at %p already in use", L1Window);
+            return -1;
+        }
+    }
+    TRY_EXCEPTION_HANDLER {
+        l1winWrite(L1WinIndex, L1WinOld, L1WIN_SECTIONS);
+    } CATCH_EXCEPTION_HANDLER {
+        Output(C_ERROR "Unable to flush tlb - L1 window not available");
+        return -1;
+    }
+    return 0;
+}
+
+// Reserve the window and work out the descriptor flags to use.
+static int
+l1winInit()
+{
+    // Use the same permissions/domain as wince uses for its own
+    // uncached mappings of ram (the ones memPhysMap_section uses) so
+    // the window is accessible in the same way.
+    L1WinFlags = 0;
+    for (uint32 i=0; i<4096; i++)
+        if (PhysMapUncached[i] >= 0) {
+            L1WinFlags = (MMUTable[PhysMapUncached[i]]
+                          & ~(MMU_L1_SECTION_MASK | MMU_L1_CACHEABLE
+                              | MMU_L1_BUFFERABLE));
+            break;
+        }
+    if (!L1WinFlags) {
+        // No template - use full access in the domain of our own data.
+        uint32 own = MMUTable[MVAddr((uint32)&L1WinFlags) >> 20];
+        if (!own) {
+            Output(C_ERROR "MMU table not available for L1 window");
+            return -1;
+        }
+        L1WinFlags = ((own & MMU_L1_DOMAIN_MASK) | (3 << MMU_L1_AP_SHIFT)
+                      | (1<<4) | MMU_L1_SECTION);
+    }
+
+    // Reserve an extra section so the window can be section aligned.
+    L1WinAlloc = VirtualAlloc(NULL, (L1WIN_SECTIONS + 1) * SECTION_SIZE
+                              , MEM_RESERVE, PAGE_NOACCESS);
+    if (!L1WinAlloc) {
+        Output(C_ERROR "Unable to reserve L1 window (%ld)", GetLastError());
+        return -1;
+    }
+    L1Window = (uint8*)ALIGN((uint32)L1WinAlloc, SECTION_SIZE);
+    L1WinIndex = MVAddr((uint32)L1Window) >> 20;
+    if (l1winCheck()) {
+        l1winRelease();
+        return -1;
+    }
+
+    for (int i=0; i<L1WIN_SLOTS; i++)
+        L1WinBase[i] = 1;
+    Output("L1 window at %p (mmu index %03x flags %08x)"
+           , L1Window, L1WinIndex, L1WinFlags);
+    return 0;
+}
+
+// Map physical memory into the L1 window.  As with memPhysMap_wm, at
+// least 32K after the address is available.
+uint8 *
+memPhysMap_l1win(uint32 paddr)
+{
+    if (!L1Window) {
+        if (L1WinFailed || l1winInit()) {
+            L1WinFailed = 1;
+            return NULL;
+        }
+    }
+
+    uint32 sect = paddr & MMU_L1_SECTION_MASK;
+    uint32 offs = paddr & ~MMU_L1_SECTION_MASK;
+    int slot, oldest = 0;
+    for (slot=0; slot<L1WIN_SLOTS; slot++) {
+        if (L1WinBase[slot] == sect)
+            break;
+        // The second section of a slot also counts if there is enough
+        // room after the address.
+        if (L1WinBase[slot] + SECTION_SIZE == sect
+            && offs <= SECTION_SIZE - PHYS_CACHE_SIZE/2) {
+            offs += SECTION_SIZE;
+            sect = L1WinBase[slot];
+            break;
+        }
+        if (L1WinAge[slot] < L1WinAge[oldest])
+            oldest = slot;
+    }
+    if (slot == L1WIN_SLOTS) {
+        // Replace the least recently used slot.
+        slot = oldest;
+        uint32 descs[L1WIN_SLOTSECTIONS];
+        for (int i=0; i<L1WIN_SLOTSECTIONS; i++)
+            descs[i] = (sect + i * SECTION_SIZE) | L1WinFlags;
+        L1WinBase[slot] = sect;
+        l1winWrite(L1WinIndex + slot * L1WIN_SLOTSECTIONS
+                   , descs, L1WIN_SLOTSECTIONS);
+    }
+    L1WinAge[slot] = ++L1WinClock;
+    return &L1Window[slot * L1WIN_SLOTSECTIONS * SECTION_SIZE + offs];
+}
+
+// Give the window back to wince.
+static void
+memPhysReset_l1win()
+{
+    if (!L1Window)
+        return;
+    l1winWrite(L1WinIndex, L1WinOld, L1WIN_SECTIONS);
+    l1winRelease();
+}
+
+// Free the mappings used by memPhysMap
+void
+memPhysReset()
+{
+    memPhysReset_wm();
+    memPhysReset_l1win();
+}
+
+
+/****************************************************************
+ * Physical map selection
+ ****************************************************************/
+
 static uint32 PhysicalMapMethod = 1;
 REG_VAR_INT(0, "PHYSMAPMETHOD", PhysicalMapMethod
-            , "Physical map method (1=1meg cache, 0=VirtualCopy only)")
+            , "Physical map method (bit 0 = reuse wince 1meg mappings,"
+              " bit 1 = L1 window, else VirtualCopy)")
 
 // Map physical memory to a virtual address. The function ensures
 // that at least 32K memory ahead of given address is available
@@ -497,14 +491,198 @@ memPhysMap(uint32 paddr)
             return ret;
     }
 
-#if 0
-    if (PhysicalMapMethod & 2)
-        return memPhysMap_bruteforce(paddr);
-#endif
+    if (PhysicalMapMethod & 2) {
+        uint8 *ret = memPhysMap_l1win(paddr);
+        if (ret)
+            return ret;
+    }
 
     return memPhysMap_wm(paddr);
 }
 
+// Compare the cost of remapping with the VirtualCopy and L1 window
+// methods.  Addresses are spread so that every map is a cache miss.
+static void
+cmd_physmapbench(const char *cmd, const char *args)
+{
+    uint32 count;
+    if (!get_expression(&args, &count))
+        count = 1000;
+    if (memPhysAddr == 0xFFFFFFFF) {
+        Output(C_ERROR "Please set start of ram (RAMADDR)");
+        return;
+    }
+    const uint32 stride = L1WIN_SLOTSECTIONS * SECTION_SIZE;
+    uint32 spots = memPhysSize / stride;
+    if (spots > 32)
+        spots = 32;
+    if (spots <= L1WIN_SLOTS) {
+        Output(C_ERROR "Not enough ram to benchmark");
+        return;
+    }
+    static const struct {
+        const char *name;
+        uint8 *(*map)(uint32 paddr);
+    } methods[] = {
+        { "VirtualCopy", memPhysMap_wm },
+        { "L1 window", memPhysMap_l1win },
+    };
+    for (uint32 m=0; m<ARRAY_SIZE(methods); m++) {
+        uint32 sum = 0, fails = 0;
+        uint32 start = GetTickCount();
+        for (uint32 i=0; i<count; i++) {
+            uint8 *p = methods[m].map(memPhysAddr + (i % spots) * stride);
+            if (!p) {
+                fails++;
+                break;
+            }
+            sum += *(volatile uint32*)p;
+        }
+        uint32 msec = GetTickCount() - start;
+        if (fails) {
+            Output("%s: unable to map", methods[m].name);
+            continue;
+        }
+        Output("%s: %d remaps in %d ms (%d ns each)", methods[m].name
+               , count, msec
+               , count ? (uint32)((uint64)msec * 1000000 / count) : 0);
+    }
+}
+REG_CMD(0, "PHYSMAPBENCH", cmd_physmapbench,
+        "PHYSMAPBENCH [<count>]\n"
+        "  Measure the cost of mapping physical memory with VirtualCopy\n"
+        "  and with the L1 window (see PHYSMAPMETHOD).")
+
+
+/****************************************************************
+ * Cached bulk reads
+ ****************************************************************/
+
+static uint32 CachedRead;
+REG_VAR_INT(0, "CACHEDREAD", CachedRead
+            , "Read ram through cached mappings for bulk reads (pwf, pdump)")
+static int CachedReadBroken;
+
+DEF_SETCPRATTR(cpuCleanDLine, p15, 0, c7, c10, 1,, "memory")
+
+// Write back the data cache lines covering a range.  The cached
+// mapping is wince's own live kernel mapping, so lines are never
+// invalidated - another thread or an isr may have written to them,
+// and reading through the same alias needs no invalidate.
+static void
+cacheClean(uint8 *vaddr, uint32 len)
+{
+    uint32 end = MVAddr((uint32)vaddr + len);
+    for (uint32 p = MVAddr((uint32)vaddr) & ~(DCACHE_LINE-1); p < end
+             ; p += DCACHE_LINE)
+        cpuCleanDLine(p);
+    cpuDrainWriteBuffer(0);
+}
+
+// As above, but disable cached reads if the cpu doesn't permit it.
+static int
+tryCacheClean(uint8 *vaddr, uint32 len)
+{
+    TRY_EXCEPTION_HANDLER {
+        cacheClean(vaddr, len);
+    } CATCH_EXCEPTION_HANDLER {
+        Output(C_WARN "Unable to clean cache lines - cached reads disabled");
+        CachedReadBroken = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Map physical memory for a read-only transfer of up to '*len' bytes
+// (at most 32K).  With CACHEDREAD set, ram is returned through a
+// cached mapping; anything else (eg, io registers) is mapped
+// uncached.  On return '*len' holds the number of bytes that may be
+// read and '*cached' the type of mapping - pass both to
+// memPhysReadDone() when finished.
+uint8 *
+memPhysMapRead(uint32 paddr, uint32 *len, int *cached)
+{
+    if (*len > PHYS_CACHE_SIZE/2)
+        *len = PHYS_CACHE_SIZE/2;
+    *cached = 0;
+    if (CachedRead && !CachedReadBroken
+        && paddr - memPhysAddr < memPhysSize) {
+        uint8 *vaddr = memPhysMap_section(paddr, 1);
+        if (vaddr) {
+            // The next section may be mapped elsewhere.
+            uint32 left = SECTION_SIZE - (paddr & (SECTION_SIZE-1));
+            if (left > memPhysAddr + memPhysSize - paddr)
+                left = memPhysAddr + memPhysSize - paddr;
+            if (*len > left)
+                *len = left;
+            if (!tryCacheClean(vaddr, *len)) {
+                *cached = 1;
+                return vaddr;
+            }
+        }
+    }
+    return memPhysMap(paddr);
+}
+
+void
+memPhysReadDone(uint8 *vaddr, uint32 len, int cached)
+{
+    if (cached)
+        cacheClean(vaddr, len);
+}
+
+// Report the speed of a transfer.
+void
+reportSpeed(const char *what, uint32 bytes, uint32 msec, int cached)
+{
+    if (!msec)
+        msec = 1;
+    uint32 kbps = (uint32)((uint64)bytes * 1000 / msec / 1024);
+    Output("%s %d bytes in %d ms (%d.%02d MB/s, %s)", what, bytes, msec
+           , kbps / 1024, (kbps % 1024) * 100 / 1024
+           , cached ? "cached" : "uncached");
+}
+
+// Read a range of physical memory with and without CACHEDREAD.
+static void
+cmd_pmemspeed(const char *cmd, const char *args)
+{
+    uint32 paddr, size;
+    if (!get_expression(&args, &paddr) || !get_expression(&args, &size)) {
+        ScriptError("Expected <paddr> <size>");
+        return;
+    }
+    paddr &= ~3;
+    uint32 oldCachedRead = CachedRead;
+    for (int pass=0; pass<2; pass++) {
+        CachedRead = pass;
+        uint32 sum = 0, done = 0, anyCached = 0;
+        uint32 start = GetTickCount();
+        while (done < size) {
+            uint32 len = size - done;
+            int cached;
+            uint32 *p = (uint32*)memPhysMapRead(paddr + done, &len, &cached);
+            if (!p) {
+                Output(C_ERROR "Unable to map %08x", paddr + done);
+                break;
+            }
+            for (uint32 i=0; i<len/4; i++)
+                sum += p[i];
+            memPhysReadDone((uint8*)p, len, cached);
+            anyCached |= cached;
+            done += len;
+        }
+        reportSpeed("Read", done, GetTickCount() - start, anyCached);
+        if (pass && !anyCached)
+            Output("No cached mapping available for this range");
+    }
+    CachedRead = oldCachedRead;
+}
+REG_CMD(0, "PMEMSPEED", cmd_pmemspeed,
+        "PMEMSPEED <paddr> <size>\n"
+        "  Measure the speed of reading physical memory with and without\n"
+        "  cached mappings (see CACHEDREAD).")
+
 // This function is called at startup - initialize memory handling routines.
 void
 setupMemory()
@@ -730,6 +908,80 @@ memVirtToPhys(uint32 vaddr)
 }
 
 
+// Find how many bytes starting at 'vaddr' (up to 'size') share the
+// same mapped/unmapped state in the L1 mmu table.  The state is
+// stored in 'isMapped'.  Only the L1 descriptors are checked - wince
+// fills in L2 entries on demand (eg, code not yet paged in), so a
+// page with an invalid L2 entry may still be readable and counts as
+// mapped here.
+uint32
+memVirtRun(uint32 vaddr, uint32 size, int *isMapped)
+{
+    uint32 len = 0;
+    int state = -1;
+    while (len < size) {
+        uint32 mva = MVAddr(vaddr + len);
+        int mapped = getL1Desc(MMUTable[mva >> 20])->isMapped;
+        if (state == -1)
+            state = mapped;
+        else if (mapped != state)
+            break;
+        uint32 step = 0x100000 - (mva & 0xfffff);
+        if (vaddr + len + step < vaddr + len)
+            // Wrapped past the end of the address space.
+            step = size - len;
+        len += step;
+    }
+    *isMapped = state;
+    return len < size ? len : size;
+}
+
+// Copy 'size' bytes from virtual address 'src' to 'dest'.  Areas
+// without an L1 mapping are zero filled (and reported) without
+// touching them.  Everything else is copied a page at a time under
+// an exception handler, which lets wince page in demand mapped pages
+// and only loses the pages that really fault.  Returns the number of
+// bytes that could not be copied.
+uint32
+safe_copy(void *dest, uint32 src, uint32 size)
+{
+    uint8 *d = (uint8*)dest;
+    uint32 missed = 0;
+    while (size) {
+        int mapped;
+        uint32 run = memVirtRun(src, size, &mapped);
+        if (!mapped) {
+            Output("Skipped unmapped %08x-%08x", src, src + run - 1);
+            memset(d, 0, run);
+            missed += run;
+            d += run;
+            src += run;
+            size -= run;
+            continue;
+        }
+        // Mapped area - copy a page at a time so a fault only loses
+        // the page it occurs in.
+        for (uint32 end = src + run; src != end; ) {
+            uint32 cnt = PAGE_SIZE - (src & (PAGE_SIZE-1));
+            if (cnt > end - src)
+                cnt = end - src;
+            TRY_EXCEPTION_HANDLER {
+                memcpy(d, (void*)src, cnt);
+            } CATCH_EXCEPTION_HANDLER {
+                Output(C_ERROR "Exception copying from %08x-%08x"
+                       , src, src + cnt - 1);
+                memset(d, 0, cnt);
+                missed += cnt;
+            }
+            d += cnt;
+            src += cnt;
+        }
+        size -= run;
+    }
+    return missed;
+}
+
+
 /****************************************************************
  * Page allocation
  ****************************************************************/
@@ -744,6 +996,9 @@ freePages(void *data)
                , data, GetLastError());
 }
 
+// Maximum number of pages passed to a single LockPages call.
+#define LOCK_BATCH 64
+
 // Allocate and pin 'pageCount' number of pages and fill 'pages'
 // structure with the physical and virtual locations of those pages.
 void *
@@ -769,23 +1024,81 @@ allocPages(struct pageAddrs *pages, int pageCount)
     if (!ret)
         Output(C_WARN "CloseHandle failed (code %ld)", GetLastError());
 
-    DWORD pfns[pageCount];
-    ret = LockPages(data, pageBytes, pfns, LOCKFLAG_WRITE);
-    if (!ret) {
-        Output(C_ERROR "Failed to lock %d pages (code %ld)"
-               , pageCount, GetLastError());
-        freePages(data);
-        return NULL;
+    // Lock the pages in bounded batches and find their physical
+    // locations.
+    DWORD pfns[LOCK_BATCH];
+    for (int i = 0; i < pageCount; i += LOCK_BATCH) {
+        int count = pageCount - i;
+        if (count > LOCK_BATCH)
+            count = LOCK_BATCH;
+        char *virt = &((char *)data)[PAGE_SIZE * i];
+        ret = LockPages(virt, count * PAGE_SIZE, pfns, LOCKFLAG_WRITE);
+        if (!ret) {
+            Output(C_ERROR "Failed to lock %d pages (code %ld)"
+                   , pageCount, GetLastError());
+            freePages(data);
+            return NULL;
+        }
+        for (int j = 0; j < count; j++) {
+            struct pageAddrs *pd = &pages[i + j];
+            pd->virtLoc = &virt[PAGE_SIZE * j];
+            pd->physLoc = pfns[j]; // XXX should: x << UserKInfo[KINX_PFN_SHIFT]
+        }
     }
 
-    // Find all the physical locations of the pages.
-    for (int i = 0; i < pageCount; i++) {
-        struct pageAddrs *pd = &pages[i];
-        pd->virtLoc = &((char *)data)[PAGE_SIZE * i];
-        pd->physLoc = pfns[i]; // XXX should: x << UserKInfo[KINX_PFN_SHIFT]
+    return data;
+}
+
+
+/****************************************************************
+ * Page arenas
+ ****************************************************************/
+
+// Make sure at least 'pageCount' pages are pinned in the arena.  On
+// success the first 'pageCount' entries of pa->pages describe usable
+// pages.  On failure the chunks already pinned are kept so that a
+// later attempt can continue from them.
+int
+arenaAlloc(struct pageArena *pa, int pageCount)
+{
+    if (pageCount > ARENA_MAX_CHUNKS * ARENA_CHUNK_PAGES) {
+        Output(C_ERROR "Can not pin %d pages (max %d)"
+               , pageCount, ARENA_MAX_CHUNKS * ARENA_CHUNK_PAGES);
+        return -1;
+    }
+    if (pa->pageCount >= pageCount) {
+        Output("Reusing %d pinned pages", pa->pageCount);
+        return 0;
     }
 
-    return data;
+    int chunks = (pageCount + ARENA_CHUNK_PAGES - 1) / ARENA_CHUNK_PAGES;
+    struct pageAddrs *pages = (struct pageAddrs *)realloc(
+        pa->pages, chunks * ARENA_CHUNK_PAGES * sizeof(pa->pages[0]));
+    if (!pages) {
+        Output(C_ERROR "Failed to allocate page list");
+        return -1;
+    }
+    pa->pages = pages;
+
+    while (pa->chunkCount < chunks) {
+        void *data = allocPages(&pages[pa->pageCount], ARENA_CHUNK_PAGES);
+        if (!data)
+            return -1;
+        pa->chunks[pa->chunkCount++] = data;
+        pa->pageCount += ARENA_CHUNK_PAGES;
+    }
+    Output("Pinned %d pages in %d chunks", pa->pageCount, pa->chunkCount);
+    return 0;
+}
+
+// Release all pages held by an arena.
+void
+arenaFree(struct pageArena *pa)
+{
+    for (int i = 0; i < pa->chunkCount; i++)
+        freePages(pa->chunks[i]);
+    free(pa->pages);
+    memset(pa, 0, sizeof(*pa));
 }
 
 
@@ -921,6 +1234,71 @@ allocContPages(int pageCount, struct continuousPageInfo **info)
 }
 
 
+/****************************************************************
+ * Cached continuous page pool
+ ****************************************************************/
+
+// Finding continuous ram can be slow (or fail) on a fragmented
+// machine, so one block is kept between users (eg, repeated "wirq"
+// sessions).  It is only reallocated when a larger block is needed.
+static struct continuousPageInfo *ContPoolInfo;
+static void *ContPoolData;
+static int ContPoolPages, ContPoolBusy;
+
+// Obtain the pool with at least 'pageCount' pages.  Release it with
+// putContPool().
+void *
+getContPool(int pageCount)
+{
+    if (ContPoolBusy) {
+        Output(C_ERROR "Continuous page pool already in use");
+        return NULL;
+    }
+    if (pageCount > ContPoolPages) {
+        freeContPool();
+        ContPoolData = allocContPages(pageCount, &ContPoolInfo);
+        if (!ContPoolData)
+            return NULL;
+        ContPoolPages = pageCount;
+    }
+    ContPoolBusy = 1;
+    return ContPoolData;
+}
+
+void
+putContPool()
+{
+    ContPoolBusy = 0;
+}
+
+// Return the pool's memory to the system.
+void
+freeContPool()
+{
+    if (!ContPoolData)
+        return;
+    if (ContPoolBusy) {
+        Output(C_ERROR "Continuous page pool in use - not freeing");
+        return;
+    }
+    freeContPages(ContPoolInfo);
+    ContPoolInfo = NULL;
+    ContPoolData = NULL;
+    ContPoolPages = 0;
+}
+
+static void
+cmd_freepool(const char *cmd, const char *args)
+{
+    if (ContPoolData)
+        Output("Freeing %d cached continuous pages", ContPoolPages);
+    freeContPool();
+}
+REG_CMD(0, "FREEPOOL", cmd_freepool,
+        "FREEPOOL\n"
+        "  Release the continuous memory kept for use by wirq.")
+
+
 /****************************************************************
  * Misc utilities
  ****************************************************************/
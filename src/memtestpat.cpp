@@ -0,0 +1,258 @@
+// Ram test patterns.
+//
+// For conditions of use see file COPYING
+//
+// This file is plain C++ (no wince or haret dependencies) so the
+// patterns can be checked and timed against a malloc'd buffer on a
+// host.  The fill and verify loops work on blocks of eight words so
+// that gcc emits ldm/stm bursts for them on arm.
+
+#include "memtest.h"
+
+
+/****************************************************************
+ * Block fill and verify
+ ****************************************************************/
+
+#define BLOCK_WORDS 8
+
+// Report each bad word in a block that failed verification.
+template<class Gen>
+static void
+reportBlock(uint32 *buf, uint32 pos, uint32 count, Gen &gen
+            , struct memtestOps *ops)
+{
+    for (uint32 i = 0; i < count; i++) {
+        uint32 expect = gen(pos + i);
+        uint32 got = buf[pos + i];
+        if (got == expect)
+            continue;
+        ops->errors++;
+        if (ops->error)
+            ops->error(ops->data, (pos + i) * sizeof(uint32), expect, got);
+    }
+}
+
+// Write gen(i) to every word of the buffer.
+template<class Gen>
+static void
+fillWords(uint32 *buf, uint32 words, Gen &gen)
+{
+    uint32 i = 0;
+    for (; i + BLOCK_WORDS <= words; i += BLOCK_WORDS) {
+        uint32 v0 = gen(i), v1 = gen(i+1), v2 = gen(i+2), v3 = gen(i+3);
+        uint32 v4 = gen(i+4), v5 = gen(i+5), v6 = gen(i+6), v7 = gen(i+7);
+        uint32 *p = &buf[i];
+        p[0] = v0; p[1] = v1; p[2] = v2; p[3] = v3;
+        p[4] = v4; p[5] = v5; p[6] = v6; p[7] = v7;
+    }
+    for (; i < words; i++)
+        buf[i] = gen(i);
+}
+
+// Check that every word of the buffer contains gen(i).  <gen> must
+// be callable again for the same index (reportBlock uses it to find
+// the bad words), so stateful generators need a fresh copy.
+template<class Gen>
+static void
+checkWords(uint32 *buf, uint32 words, Gen &gen, struct memtestOps *ops)
+{
+    uint32 i = 0;
+    for (; i + BLOCK_WORDS <= words; i += BLOCK_WORDS) {
+        uint32 *p = &buf[i];
+        uint32 d0 = p[0], d1 = p[1], d2 = p[2], d3 = p[3];
+        uint32 d4 = p[4], d5 = p[5], d6 = p[6], d7 = p[7];
+        uint32 bad = ((d0 ^ gen(i)) | (d1 ^ gen(i+1))
+                      | (d2 ^ gen(i+2)) | (d3 ^ gen(i+3))
+                      | (d4 ^ gen(i+4)) | (d5 ^ gen(i+5))
+                      | (d6 ^ gen(i+6)) | (d7 ^ gen(i+7)));
+        if (bad)
+            reportBlock(buf, i, BLOCK_WORDS, gen, ops);
+    }
+    if (i < words)
+        reportBlock(buf, i, words - i, gen, ops);
+}
+
+static inline void
+syncMem(struct memtestOps *ops)
+{
+    if (ops->sync)
+        ops->sync();
+}
+
+template<class Gen>
+static void
+fillAndCheck(uint32 *buf, uint32 words, Gen gen, struct memtestOps *ops)
+{
+    fillWords(buf, words, gen);
+    syncMem(ops);
+    checkWords(buf, words, gen, ops);
+}
+
+
+/****************************************************************
+ * Walking bits
+ ****************************************************************/
+
+struct walkGen {
+    uint32 invert;
+    uint32 operator()(uint32 i) { return (1 << (i % 32)) ^ invert; }
+};
+
+// Walking ones followed by walking zeros - each word has a single
+// bit set (or clear) and the bit moves along with the address.
+static void
+testWalk(uint32 *buf, uint32 words, uint32 base, uint32 seed
+         , struct memtestOps *ops)
+{
+    walkGen ones = { 0 };
+    fillAndCheck(buf, words, ones, ops);
+    walkGen zeros = { ~0u };
+    fillAndCheck(buf, words, zeros, ops);
+}
+
+
+/****************************************************************
+ * Address in address
+ ****************************************************************/
+
+struct addrGen {
+    uint32 base, invert;
+    uint32 operator()(uint32 i) { return (base + i * 4) ^ invert; }
+};
+
+// Each word holds its own address (and then its complement) - finds
+// shorted or stuck address lines.
+static void
+testAddress(uint32 *buf, uint32 words, uint32 base, uint32 seed
+            , struct memtestOps *ops)
+{
+    addrGen addr = { base, 0 };
+    fillAndCheck(buf, words, addr, ops);
+    addrGen inv = { base, ~0u };
+    fillAndCheck(buf, words, inv, ops);
+}
+
+
+/****************************************************************
+ * Random data
+ ****************************************************************/
+
+// Xorshift generator.  Words are produced in index order, so a run
+// is reproduced by restarting from the seed.  Random lookups (from
+// reportBlock) step the generator back from the last block start.
+struct randGen {
+    uint32 state, blockState, blockPos, pos;
+    randGen(uint32 seed) {
+        state = blockState = seed ? seed : 0x2545f491;
+        blockPos = pos = 0;
+    }
+    static uint32 next(uint32 x) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return x;
+    }
+    uint32 operator()(uint32 i) {
+        if (i != pos) {
+            // Rewind to the start of the current block.
+            if (i < pos) {
+                state = blockState;
+                pos = blockPos;
+            }
+            while (pos < i) {
+                state = next(state);
+                pos++;
+            }
+        }
+        if (!(i % BLOCK_WORDS)) {
+            blockState = state;
+            blockPos = i;
+        }
+        uint32 val = state;
+        state = next(state);
+        pos++;
+        return val;
+    }
+};
+
+static void
+testRandom(uint32 *buf, uint32 words, uint32 base, uint32 seed
+           , struct memtestOps *ops)
+{
+    randGen fill(seed);
+    fillWords(buf, words, fill);
+    syncMem(ops);
+    randGen check(seed);
+    checkWords(buf, words, check, ops);
+}
+
+
+/****************************************************************
+ * March C-
+ ****************************************************************/
+
+struct constGen {
+    uint32 v;
+    uint32 operator()(uint32 i) { return v; }
+};
+
+// Read every word (ascending or descending), check it contains
+// <expect>, and (if <write>) replace it with <val>.
+static void
+marchElement(uint32 *buf, uint32 words, uint32 expect, int write, uint32 val
+             , int down, struct memtestOps *ops)
+{
+    constGen gen = { expect };
+    uint32 blocks = words / BLOCK_WORDS;
+    for (uint32 n = 0; n < blocks; n++) {
+        uint32 i = (down ? blocks - 1 - n : n) * BLOCK_WORDS;
+        uint32 *p = &buf[i];
+        uint32 d0 = p[0], d1 = p[1], d2 = p[2], d3 = p[3];
+        uint32 d4 = p[4], d5 = p[5], d6 = p[6], d7 = p[7];
+        if ((d0 ^ expect) | (d1 ^ expect) | (d2 ^ expect) | (d3 ^ expect)
+            | (d4 ^ expect) | (d5 ^ expect) | (d6 ^ expect) | (d7 ^ expect))
+            reportBlock(buf, i, BLOCK_WORDS, gen, ops);
+        if (write) {
+            p[0] = val; p[1] = val; p[2] = val; p[3] = val;
+            p[4] = val; p[5] = val; p[6] = val; p[7] = val;
+        }
+    }
+    uint32 tail = blocks * BLOCK_WORDS;
+    if (tail < words) {
+        reportBlock(buf, tail, words - tail, gen, ops);
+        if (write)
+            for (uint32 i = tail; i < words; i++)
+                buf[i] = val;
+    }
+    syncMem(ops);
+}
+
+// March C-: up(w0); up(r0,w1); up(r1,w0); down(r0,w1); down(r1,w0);
+// up(r0) - finds stuck-at, transition and most coupling faults.
+static void
+testMarch(uint32 *buf, uint32 words, uint32 base, uint32 seed
+          , struct memtestOps *ops)
+{
+    constGen zero = { 0 };
+    fillWords(buf, words, zero);
+    syncMem(ops);
+    marchElement(buf, words, 0, 1, ~0u, 0, ops);
+    marchElement(buf, words, ~0u, 1, 0, 0, ops);
+    marchElement(buf, words, 0, 1, ~0u, 1, ops);
+    marchElement(buf, words, ~0u, 1, 0, 1, ops);
+    marchElement(buf, words, 0, 0, 0, 0, ops);
+}
+
+
+/****************************************************************
+ * Pattern list
+ ****************************************************************/
+
+const struct memtestPattern MemtestPatterns[] = {
+    { "walk", testWalk, 4 },
+    { "address", testAddress, 4 },
+    { "random", testRandom, 2 },
+    { "march", testMarch, 10 },
+};
+const int MemtestPatternCount = ARRAY_SIZE(MemtestPatterns);
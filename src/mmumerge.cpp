@@ -64,6 +64,12 @@ int prepMMUMerge(struct irqData *data)
 	return 0;
 }
 
+// Number of entries prepMMUMerge will watch (see IRQLINES)
+uint32 mmuMergeCount()
+{
+	return MMUMergeCount > 4096 ? 0 : MMUMergeCount;
+}
+
 // start
 void startMMUMerge(struct irqData *data)
 { 
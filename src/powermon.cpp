@@ -0,0 +1,299 @@
+/* Battery and power status monitoring.
+ *
+ * For conditions of use see file COPYING
+ */
+
+#include <windows.h> // GetSystemPowerStatusEx2
+#include <stdio.h> // FILE, fopen
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+
+#include "xtypes.h" // uint32
+#include "output.h" // Output, fnprepare
+#include "script.h" // REG_CMD
+#include "lateload.h" // LATE_LOAD
+#include "powermon.h"
+
+// The GetSystemPowerStatusEx2 is only available on wince 2.12 and
+// later.  However, earlier versions of CE have GetSystemPowerStatusEx
+// which uses a struct that is compatible (but smaller) than the
+// original.
+DWORD alt_GetSystemPowerStatusEx2(
+    PSYSTEM_POWER_STATUS_EX2 pSystemPowerStatusEx2, DWORD dwLen, BOOL fUpdate)
+{
+    bool ret = GetSystemPowerStatusEx(
+        (SYSTEM_POWER_STATUS_EX *)pSystemPowerStatusEx2, fUpdate);
+    if (ret)
+        return sizeof(SYSTEM_POWER_STATUS_EX);
+    return 0;
+}
+
+LATE_LOAD_ALT(GetSystemPowerStatusEx2, "coredll")
+
+
+/****************************************************************
+ * Sampler
+ ****************************************************************/
+
+struct powerSample {
+    uint32 msec;
+    int32 voltage, current, avgCurrent;
+    uint32 events;
+    uint8 percent, acLine;
+};
+
+// Number of samples kept (older samples are overwritten).
+static uint32 PowerSamples = 4096;
+REG_VAR_INT(0, "POWERSAMPLES", PowerSamples,
+            "Number of samples kept by high frequency power monitoring")
+
+// Number of samples in the moving average of the current.
+#define POWER_AVG 8
+
+static struct powerSampler {
+    powerSample *ring;
+    uint32 size, count;
+    uint32 interval, start_time, next_time, events;
+    // Running statistics over all samples (not just those kept).
+    int32 minVolt, maxVolt, minCur, maxCur;
+    int64 sumVolt, sumCur;
+    uint32 total, changes, lastChange;
+    int32 window[POWER_AVG], windowSum;
+} PS;
+
+static void
+voltCurStats(int32 v, int32 *minv, int32 *maxv, int64 *sum)
+{
+    if (v < *minv)
+        *minv = v;
+    if (v > *maxv)
+        *maxv = v;
+    *sum += v;
+}
+
+// Prepare to sample every 'interval' milliseconds.  Returns non-zero
+// on error.
+int
+powerSampleStart(uint32 interval)
+{
+    powerSampleStop();
+    memset(&PS, 0, sizeof(PS));
+    if (!PowerSamples)
+        PowerSamples = 1;
+    PS.ring = (powerSample*)malloc(PowerSamples * sizeof(PS.ring[0]));
+    if (!PS.ring) {
+        Output(C_ERROR "Unable to allocate %d power samples", PowerSamples);
+        return -1;
+    }
+    PS.size = PowerSamples;
+    PS.interval = interval;
+    PS.minVolt = PS.minCur = 0x7fffffff;
+    PS.maxVolt = PS.maxCur = -0x7fffffff;
+    PS.start_time = PS.next_time = GetTickCount();
+    return 0;
+}
+
+// Take a sample if the interval has passed.  'events' is a running
+// count of events (eg, irqs) to be recorded along side the sample.
+void
+powerSamplePoll(uint32 events)
+{
+    if (!PS.ring)
+        return;
+    uint32 now = GetTickCount();
+    if ((int32)(now - PS.next_time) < 0)
+        return;
+    PS.next_time += PS.interval;
+    if ((int32)(now - PS.next_time) >= 0)
+        // Fell behind - don't try to catch up.
+        PS.next_time = now + PS.interval;
+
+    SYSTEM_POWER_STATUS_EX2 stat2;
+    memset(&stat2, 0, sizeof(stat2));
+    // Ask for an update so the driver's values are as fresh as it
+    // can provide.
+    if (!late_GetSystemPowerStatusEx2(&stat2, sizeof(stat2), true))
+        return;
+
+    powerSample *prev = NULL;
+    if (PS.count)
+        prev = &PS.ring[(PS.count - 1) % PS.size];
+    powerSample *s = &PS.ring[PS.count % PS.size];
+    s->msec = now - PS.start_time;
+    s->voltage = stat2.BatteryVoltage;
+    s->current = stat2.BatteryCurrent;
+    s->percent = stat2.BatteryLifePercent;
+    s->acLine = stat2.ACLineStatus;
+    s->events = events - PS.events;
+    PS.events = events;
+    if (!PS.count)
+        s->events = 0;
+
+    // Track how often the driver actually reports new values.
+    if (prev && (prev->voltage != s->voltage || prev->current != s->current)) {
+        PS.changes++;
+        PS.lastChange = s->msec;
+    }
+
+    int32 *slot = &PS.window[PS.total % POWER_AVG];
+    PS.windowSum += s->current - *slot;
+    *slot = s->current;
+    uint32 n = PS.total + 1 < POWER_AVG ? PS.total + 1 : POWER_AVG;
+    s->avgCurrent = PS.windowSum / (int32)n;
+
+    voltCurStats(s->voltage, &PS.minVolt, &PS.maxVolt, &PS.sumVolt);
+    voltCurStats(s->current, &PS.minCur, &PS.maxCur, &PS.sumCur);
+    PS.total++;
+    PS.count++;
+}
+
+// Report statistics and write the kept samples as csv to 'fn' (or
+// to the output if 'fn' is empty).
+void
+powerSampleFinish(const char *fn)
+{
+    if (!PS.ring)
+        return;
+    if (!PS.total) {
+        Output("No power samples taken");
+        powerSampleStop();
+        return;
+    }
+    Output("%d power samples every %d ms"
+           , PS.total, PS.interval);
+    Output("voltage avg %d min %d max %d, current avg %d min %d max %d"
+           , (int32)(PS.sumVolt / PS.total), PS.minVolt, PS.maxVolt
+           , (int32)(PS.sumCur / PS.total), PS.minCur, PS.maxCur);
+    if (PS.changes)
+        Output("Driver reported new values %d times (about every %d ms)"
+               , PS.changes, PS.lastChange / PS.changes);
+    else
+        Output(C_WARN "Driver values never changed - interval may be"
+               " below its refresh rate");
+
+    FILE *f = NULL;
+    if (fn && fn[0]) {
+        char vfn[MAX_CMDLEN];
+        fnprepare(fn, vfn, sizeof(vfn));
+        f = fopen(vfn, "w");
+        if (!f)
+            Output(C_ERROR "Cannot write file %s", vfn);
+    }
+    const char *hdr = "msec,mV,mA,avgmA,percent,ac,events";
+    if (f)
+        fprintf(f, "%s\n", hdr);
+    else
+        Output("%s", hdr);
+    uint32 first = PS.count > PS.size ? PS.count - PS.size : 0;
+    for (uint32 i=first; i<PS.count; i++) {
+        powerSample *s = &PS.ring[i % PS.size];
+        if (f)
+            fprintf(f, "%d,%d,%d,%d,%d,%d,%d\n", s->msec, s->voltage
+                    , s->current, s->avgCurrent, s->percent, s->acLine
+                    , s->events);
+        else
+            Output("%d,%d,%d,%d,%d,%d,%d", s->msec, s->voltage
+                   , s->current, s->avgCurrent, s->percent, s->acLine
+                   , s->events);
+    }
+    if (f) {
+        fclose(f);
+        Output("Wrote %d samples to %s", PS.count - first, fn);
+    }
+    powerSampleStop();
+}
+
+void
+powerSampleStop()
+{
+    free(PS.ring);
+    PS.ring = NULL;
+}
+
+// Options for sampling power alongside "wirq".
+uint32 WirqPower;
+REG_VAR_INT(0, "WIRQPOWER", WirqPower,
+            "Sample power status every this many ms during WIRQ (0 = off)")
+char *WirqPowerFile;
+REG_VAR_STR(0, "WIRQPOWERFILE", WirqPowerFile,
+            "File to write the WIRQPOWER samples to (csv)")
+
+
+/****************************************************************
+ * Commands
+ ****************************************************************/
+
+static void
+powerMon(const char *cmd, const char *args)
+{
+    uint32 seconds, interval;
+    if (!get_expression(&args, &seconds))
+        seconds = 0;
+    if (get_expression(&args, &interval)) {
+        char fn[MAX_CMDLEN];
+        if (get_token(&args, fn, sizeof(fn)))
+            fn[0] = 0;
+        if (!interval)
+            interval = 1;
+        if (powerSampleStart(interval))
+            return;
+        uint32 fin_time = GetTickCount() + seconds * 1000;
+        for (;;) {
+            powerSamplePoll(0);
+            if ((int32)(GetTickCount() - fin_time) >= 0)
+                break;
+            Sleep(interval < 10 ? 1 : interval / 2);
+        }
+        powerSampleFinish(fn);
+        return;
+    }
+
+    uint32 start_time = GetTickCount();
+    uint32 cur_time = start_time;
+    uint32 fin_time = cur_time + seconds * 1000;
+
+    for (;;) {
+        SYSTEM_POWER_STATUS_EX2 stat2;
+        memset(&stat2, 0, sizeof(stat2));
+        int ret = late_GetSystemPowerStatusEx2(&stat2, sizeof(stat2), false);
+        if (!ret) {
+            Output(C_INFO "GetSystemPowerStatusEx2");
+            return;
+        }
+
+        Output("%06d: %5d %5d %% %5ld %5ld %5ld %5ld "
+               "%5d %5d %5ld %5ld %5d %5d"
+               "  %5d %5d %5ld %5ld %5ld %5ld %5ld %5d",
+               cur_time - start_time,                  //
+               stat2.BatteryFlag,                      //
+               stat2.BatteryLifePercent,               //
+               stat2.BatteryVoltage,                   //
+               stat2.BatteryCurrent,                   //
+               stat2.BatteryAverageCurrent,            //
+               stat2.BatteryTemperature,               //
+               stat2.ACLineStatus,                     //  0x00
+               stat2.Reserved1,                        //  0x00
+               stat2.BatteryLifeTime,                  //  -1
+               stat2.BatteryFullLifeTime,              //  -1
+               stat2.Reserved2,                        //  0x00
+               stat2.BackupBatteryFlag,                //  0x01
+               stat2.BackupBatteryLifePercent,         //  255
+               stat2.Reserved3,                        //  0x00
+               stat2.BackupBatteryLifeTime,            //  -1
+               stat2.BackupBatteryFullLifeTime,        //  -1
+               stat2.BatteryAverageInterval,           //  0
+               stat2.BatterymAHourConsumed,            //  0
+               stat2.BackupBatteryVoltage,             //  0
+               stat2.BatteryChemistry);                 //  5
+
+        cur_time = GetTickCount();
+        if (cur_time >= fin_time)
+            break;
+        Sleep(1000);
+    }
+}
+REG_CMD(0, "POWERMON", powerMon,
+        "POWERMON [<seconds> [<msec> [<file>]]]\n"
+        "  Watch power status.  If <msec> is given, sample every <msec>\n"
+        "  milliseconds into a buffer (see POWERSAMPLES) and report\n"
+        "  statistics and a csv dump (to <file> if given) at the end.")
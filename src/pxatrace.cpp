@@ -9,6 +9,9 @@
 #include "arch-pxa.h" // testPXA
 #include "output.h" // Output
 #include "arminsns.h" // getInsnName
+#include "tlhcmds.h" // modAnnotate
+#include "memory.h" // memPhysMap
+#include "machines.h" // Mach
 #include "irq.h"
 
 // The DBCON software debug register
@@ -89,8 +92,10 @@ static void
 report_memAccess(irqData *, const char *header, traceitem *item)
 {
     uint32 pc=item->d0, insn=item->d1, Rd=item->d2, Rn=item->d3;
-    Output("%s debug %08x: %08x(%s) %08x %08x"
-           , header, pc, insn, getInsnName(insn), Rd, Rn);
+    char modbuf[64];
+    modAnnotate(modbuf, sizeof(modbuf), pc);
+    Output("%s debug %08x: %08x(%s) %08x %08x%s"
+           , header, pc, insn, getInsnName(insn), Rd, Rn, modbuf);
 }
 
 // Code that handles memory access events.
@@ -119,8 +124,10 @@ static void
 report_insnTrace(irqData *, const char *header, traceitem *item)
 {
     uint32 pc=item->d0, reg1=item->d1, reg2=item->d2;
-    Output("%s break %08x: %08x %08x"
-           , header, pc, reg1, reg2);
+    char modbuf[64];
+    modAnnotate(modbuf, sizeof(modbuf), pc);
+    Output("%s break %08x: %08x %08x%s"
+           , header, pc, reg1, reg2, modbuf);
 }
 
 // Code that handles instruction breakpoint events.
@@ -285,3 +292,134 @@ prepPXAtraps(struct irqData *data)
 
     return 0;
 }
+
+
+/****************************************************************
+ * PXA fixed rate sampling
+ ****************************************************************/
+
+// Instead of only polling IRQS/TRACES when wince takes an interrupt,
+// a spare OS timer match register can be set to interrupt at a fixed
+// rate.  Haret acknowledges that interrupt itself, so wince never
+// sees it.
+
+#define OST_BASE 0x40A00000
+#define INTC_BASE 0x40D00000
+// Word offsets of the OS timer and interrupt controller registers.
+#define OST_OSMR(ch) (ch)
+#define OST_OSCR 4
+#define OST_OSSR 5
+#define OST_OIER 7
+#define INTC_ICIP 0
+#define INTC_ICMR 1
+#define INTC_ICLR 2
+#define INTC_ICIP2 0x27
+#define IRQ_OST(ch) (26 + (ch))
+
+static uint32 sampleRate = 0;
+static uint32 sampleChannel = 2;
+REG_VAR_INT(testPXA, "WIRQRATE", sampleRate,
+            "Poll IRQS/TRACES this many times a second during WIRQ"
+            " using an OS timer (0 = only on wince irqs)")
+REG_VAR_INT(testPXA, "WIRQTIMER", sampleChannel,
+            "OS timer match register (1-3) used by WIRQRATE")
+
+// Handle a tick of the sampling timer.  Returns 1 if the interrupt
+// was from the sampling timer.
+int __irq
+PXA_sample_tick(struct irqData *data)
+{
+    volatile uint32 *ost = data->ostRegs;
+    if (!ost)
+        return 0;
+    uint32 bit = 1 << data->sampleChannel;
+    if (!(ost[OST_OSSR] & bit))
+        return 0;
+    // Schedule the next tick from the last match (so the rate doesn't
+    // drift) unless that time has already passed.
+    uint32 next = ost[OST_OSMR(data->sampleChannel)] + data->sampleInterval;
+    uint32 now = ost[OST_OSCR];
+    if ((int32)(next - now) <= 0) {
+        next = now + data->sampleInterval;
+        data->sampleLate++;
+    }
+    ost[OST_OSMR(data->sampleChannel)] = next;
+    ost[OST_OSSR] = bit;
+    data->sampleCount++;
+    return 1;
+}
+
+// Are any interrupts (other than an acknowledged sample tick) pending?
+int __irq
+PXA_irq_pending(struct irqData *data)
+{
+    volatile uint32 *intc = data->intcRegs;
+    // PXA27x irqs 32 and up are pending in ICIP2.
+    return intc[INTC_ICIP] != 0 || (data->sampleICIP2 && intc[INTC_ICIP2]);
+}
+
+void
+startPXAsampler(struct irqData *data)
+{
+    volatile uint32 *ost = data->ostRegs, *intc = data->intcRegs;
+    if (!ost)
+        return;
+    uint32 ch = data->sampleChannel;
+    ost[OST_OSMR(ch)] = ost[OST_OSCR] + data->sampleInterval;
+    ost[OST_OSSR] = 1 << ch;
+    ost[OST_OIER] |= 1 << ch;
+    data->sampleICLR = intc[INTC_ICLR] & (1 << IRQ_OST(ch));
+    intc[INTC_ICLR] &= ~(1 << IRQ_OST(ch));
+    intc[INTC_ICMR] |= 1 << IRQ_OST(ch);
+}
+
+void
+stopPXAsampler(struct irqData *data)
+{
+    volatile uint32 *ost = data->ostRegs, *intc = data->intcRegs;
+    if (!ost)
+        return;
+    uint32 ch = data->sampleChannel;
+    intc[INTC_ICMR] &= ~(1 << IRQ_OST(ch));
+    intc[INTC_ICLR] |= data->sampleICLR;
+    ost[OST_OIER] &= ~(1 << ch);
+    ost[OST_OSSR] = 1 << ch;
+}
+
+// Prepare the sampling timer (if WIRQRATE is set).
+int
+prepPXAsampler(struct irqData *data)
+{
+    data->ostRegs = data->intcRegs = NULL;
+    if (!sampleRate || !data->isPXA)
+        return 0;
+    if (sampleChannel < 1 || sampleChannel > 3) {
+        Output(C_ERROR "WIRQTIMER must be 1, 2, or 3");
+        return -1;
+    }
+    uint32 interval = Mach->clockKHz * 1000 / sampleRate;
+    if (interval < 100) {
+        Output(C_ERROR "WIRQRATE %d too high (max %d)"
+               , sampleRate, Mach->clockKHz * 10);
+        return -1;
+    }
+    uint32 *ost = (uint32*)memPhysMap(OST_BASE);
+    uint32 *intc = (uint32*)memPhysMap(INTC_BASE);
+    if (!ost || !intc) {
+        Output(C_ERROR "Unable to map OS timer registers");
+        return -1;
+    }
+    if (ost[OST_OIER] & (1 << sampleChannel)) {
+        Output(C_ERROR "OS timer %d is in use by wince"
+               " - set WIRQTIMER to another channel", sampleChannel);
+        return -1;
+    }
+    data->ostRegs = ost;
+    data->intcRegs = intc;
+    data->sampleChannel = sampleChannel;
+    data->sampleInterval = interval;
+    data->sampleICIP2 = testPXA27x();
+    Output("Sampling at %d Hz using OS timer %d (%d ticks)"
+           , sampleRate, sampleChannel, interval);
+    return 0;
+}
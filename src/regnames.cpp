@@ -0,0 +1,168 @@
+/* Lookup of peripheral register names.
+ *
+ * For conditions of use see file COPYING
+ */
+
+#include <stdio.h> // _snprintf
+#include <string.h> // strcmp
+
+#include "xtypes.h"
+#include "output.h" // Output
+#include "script.h" // REG_CMD
+#include "machines.h" // Mach
+#include "memory.h" // memPhysRead
+#include "regnames.h"
+
+// Find the table for the current machine - a machine specific table
+// is preferred over the generic architecture one (the same choice
+// haretconsole/memalias.py makes).
+static const struct regTable *
+findTable()
+{
+    static const struct regTable *table;
+    static int checked;
+    if (checked)
+        return table;
+    checked = 1;
+    for (int i=0; i<RegTableCount; i++)
+        if (!strcmp(RegTables[i].mach, Mach->name))
+            return table = &RegTables[i];
+    for (int i=0; i<RegTableCount; i++) {
+        const char *m = RegTables[i].mach;
+        if (!strncmp(m, "ARCH:", 5) && !strcmp(&m[5], Mach->archname))
+            return table = &RegTables[i];
+    }
+    return NULL;
+}
+
+// Return the index of the first register at or after 'paddr'
+// (binary search of the sorted table).
+static uint32
+lowerBound(const struct regTable *t, uint32 paddr)
+{
+    uint32 lo = 0, hi = t->count;
+    while (lo < hi) {
+        uint32 mid = (lo + hi) / 2;
+        if (t->regs[mid].paddr < paddr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Find the register at a physical address.
+const struct regName *
+regLookup(uint32 paddr)
+{
+    const struct regTable *t = findTable();
+    if (!t)
+        return NULL;
+    uint32 pos = lowerBound(t, paddr);
+    if (pos < t->count && t->regs[pos].paddr == paddr)
+        return &t->regs[pos];
+    return NULL;
+}
+
+// Extract the bits in 'mask' from 'val' as a packed number.
+static uint32
+extractBits(uint32 val, uint32 mask)
+{
+    uint32 out = 0, pos = 0;
+    for (int i=0; i<32; i++) {
+        if (!(mask & (1<<i)))
+            continue;
+        if (val & (1<<i))
+            out |= 1<<pos;
+        pos++;
+    }
+    return out;
+}
+
+// Describe a register value - only the named bits in 'changed' are
+// shown (or all of them if 'changed' is zero).
+static void
+regDescribe(char *buf, int len, const struct regName *rn
+            , uint32 val, uint32 changed)
+{
+    if (!changed)
+        changed = ~0;
+    int pos = _snprintf(buf, len, "%s", rn->name);
+    for (uint32 i=0; i<rn->bitCount; i++) {
+        const struct regBitName *rb = &rn->bits[i];
+        if (!(rb->mask & changed))
+            continue;
+        if (pos < 0 || pos >= len)
+            break;
+        int ret = _snprintf(&buf[pos], len - pos, " %s=%x"
+                            , rb->name, extractBits(val, rb->mask));
+        if (ret < 0)
+            break;
+        pos += ret;
+    }
+    buf[len-1] = 0;
+}
+
+static uint32 RegNames;
+REG_VAR_INT(0, "REGNAMES", RegNames,
+            "Show register names in watch reports")
+
+// Fill 'buf' with " <regname bits...>" if REGNAMES is set and the
+// register is known; otherwise an empty string.
+void
+regAnnotate(char *buf, int len, uint32 paddr, uint32 val, uint32 changed)
+{
+    buf[0] = 0;
+    if (!RegNames || paddr == (uint32)-1)
+        return;
+    const struct regName *rn = regLookup(paddr);
+    if (!rn)
+        return;
+    char desc[128];
+    regDescribe(desc, sizeof(desc), rn, val, changed);
+    _snprintf(buf, len, " <%s>", desc);
+    buf[len-1] = 0;
+}
+
+// Show the known registers in a physical address range (used after a
+// pdump when REGNAMES is set).
+void
+regDumpRange(uint32 paddr, uint32 size)
+{
+    const struct regTable *t = findTable();
+    if (!RegNames || !t)
+        return;
+    for (uint32 pos = lowerBound(t, paddr); pos < t->count; pos++) {
+        const struct regName *rn = &t->regs[pos];
+        if (rn->paddr - paddr >= size)
+            break;
+        char desc[MAX_CMDLEN];
+        uint32 val = memPhysRead(rn->paddr);
+        regDescribe(desc, sizeof(desc), rn, val, 0);
+        Output("%08x=%08x %s", rn->paddr, val, desc);
+    }
+}
+
+static void
+cmd_reginfo(const char *cmd, const char *args)
+{
+    uint32 paddr, val;
+    if (!get_expression(&args, &paddr)) {
+        ScriptError("Expected <paddr> [<value>]");
+        return;
+    }
+    const struct regName *rn = regLookup(paddr);
+    if (!rn) {
+        Output("No register known at %08x", paddr);
+        return;
+    }
+    if (!get_expression(&args, &val))
+        val = memPhysRead(paddr);
+    char desc[MAX_CMDLEN];
+    regDescribe(desc, sizeof(desc), rn, val, 0);
+    Output("%08x=%08x %s", paddr, val, desc);
+}
+REG_CMD(0, "REGINFO", cmd_reginfo,
+        "REGINFO <paddr> [<value>]\n"
+        "  Show the name and bit fields of the register at <paddr> for\n"
+        "  <value> (or its current contents).")
@@ -0,0 +1,314 @@
+/* Snapshots of peripheral register blocks and diffs between them.
+ *
+ * For conditions of use see file COPYING
+ */
+
+#include <windows.h> // GetTickCount
+#include <stdlib.h> // malloc
+#include <string.h> // strcmp
+
+#include "xtypes.h"
+#include "output.h" // Output
+#include "script.h" // REG_CMD
+#include "memory.h" // memPhysMap
+#include "exceptions.h" // TRY_EXCEPTION_HANDLER
+
+
+/****************************************************************
+ * Register blocks
+ ****************************************************************/
+
+// Blocks are declared by each Machine::init() (see "addregblock").
+struct regBlock {
+    char name[16];
+    uint32 paddr, size;
+    uint32 width;
+};
+
+#define MAX_REGBLOCKS 32
+static regBlock RegBlocks[MAX_REGBLOCKS];
+static uint RegBlockCount;
+
+static void
+cmd_addregblock(const char *cmd, const char *args)
+{
+    char name[MAX_CMDLEN];
+    uint32 paddr, size, width;
+    if (get_token(&args, name, sizeof(name))
+        || !get_expression(&args, &paddr)
+        || !get_expression(&args, &size)) {
+        ScriptError("Expected <name> <paddr> <size> [<width>]");
+        return;
+    }
+    if (!get_expression(&args, &width))
+        width = 4;
+    if ((width != 1 && width != 2 && width != 4)
+        || (paddr & (width-1)) || !size || (size & (width-1))) {
+        ScriptError("Invalid block alignment or width");
+        return;
+    }
+    if (RegBlockCount >= MAX_REGBLOCKS) {
+        ScriptError("Too many register blocks");
+        return;
+    }
+    regBlock *rb = &RegBlocks[RegBlockCount++];
+    strncpy(rb->name, name, sizeof(rb->name));
+    rb->name[sizeof(rb->name)-1] = 0;
+    rb->paddr = paddr;
+    rb->size = size;
+    rb->width = width;
+}
+REG_CMD(0, "ADDREGBLOCK", cmd_addregblock,
+        "ADDREGBLOCK <name> <paddr> <size> [<width>]\n"
+        "  Add a block of registers to those saved by REGSNAP.  <width>\n"
+        "  is the access size in bytes (1, 2, or 4 - default 4).")
+
+static void
+cmd_regblocks(const char *cmd, const char *args)
+{
+    for (uint i=0; i<RegBlockCount; i++) {
+        regBlock *rb = &RegBlocks[i];
+        Output("%-15s %08x-%08x %d", rb->name, rb->paddr
+               , rb->paddr + rb->size - 1, rb->width);
+    }
+}
+REG_CMD(0, "REGBLOCKS", cmd_regblocks,
+        "REGBLOCKS\n"
+        "  List the register blocks saved by REGSNAP.")
+
+
+/****************************************************************
+ * Snapshots
+ ****************************************************************/
+
+// A snapshot stores the contents of every block back to back.
+struct regSnap {
+    char name[16];
+    uint32 time;
+    uint blockCount;
+    uint32 failedBlocks;
+    uint8 *data;
+};
+
+#define MAX_REGSNAPS 8
+static regSnap RegSnaps[MAX_REGSNAPS];
+
+// Read one block into 'dest' - the physical mapping is reused for up
+// to 32K at a time (see memPhysMap).
+static bool
+readBlock(regBlock *rb, uint8 *dest)
+{
+    bool ok = true;
+    TRY_EXCEPTION_HANDLER {
+        uint32 pos = 0;
+        while (pos < rb->size) {
+            uint32 paddr = rb->paddr + pos;
+            uint8 *virt = memPhysMap(paddr & ~3);
+            if (!virt) {
+                ok = false;
+                break;
+            }
+            virt += paddr & 3;
+            uint32 count = (PHYS_CACHE_SIZE/2) - (paddr & (PHYS_CACHE_MASK>>1));
+            if (count > rb->size - pos)
+                count = rb->size - pos;
+            switch (rb->width) {
+            case 1:
+                for (uint32 i=0; i<count; i++)
+                    dest[pos+i] = ((volatile uint8*)virt)[i];
+                break;
+            case 2:
+                for (uint32 i=0; i<count; i+=2)
+                    *(uint16*)&dest[pos+i] = *(volatile uint16*)&virt[i];
+                break;
+            default:
+                for (uint32 i=0; i<count; i+=4)
+                    *(uint32*)&dest[pos+i] = *(volatile uint32*)&virt[i];
+                break;
+            }
+            pos += count;
+        }
+    } CATCH_EXCEPTION_HANDLER {
+        ok = false;
+    }
+    return ok;
+}
+
+static uint32
+snapSize(uint blockCount)
+{
+    uint32 size = 0;
+    for (uint i=0; i<blockCount; i++)
+        size += RegBlocks[i].size;
+    return size;
+}
+
+static regSnap *
+findSnap(const char *name)
+{
+    for (int i=0; i<MAX_REGSNAPS; i++)
+        if (RegSnaps[i].data && !strcmp(RegSnaps[i].name, name))
+            return &RegSnaps[i];
+    return NULL;
+}
+
+static void
+freeSnap(regSnap *rs)
+{
+    free(rs->data);
+    rs->data = NULL;
+}
+
+// Fill in a snapshot of all currently declared blocks.
+static bool
+takeSnap(regSnap *rs, const char *name)
+{
+    uint8 *data = (uint8*)malloc(snapSize(RegBlockCount));
+    if (!data) {
+        Output(C_ERROR "Unable to allocate register snapshot");
+        return false;
+    }
+    strncpy(rs->name, name, sizeof(rs->name));
+    rs->name[sizeof(rs->name)-1] = 0;
+    rs->data = data;
+    rs->blockCount = RegBlockCount;
+    rs->failedBlocks = 0;
+    rs->time = GetTickCount();
+    for (uint i=0; i<RegBlockCount; i++) {
+        regBlock *rb = &RegBlocks[i];
+        if (!readBlock(rb, data)) {
+            Output(C_WARN "Unable to read register block %s", rb->name);
+            rs->failedBlocks |= 1<<i;
+        }
+        data += rb->size;
+    }
+    return true;
+}
+
+static void
+cmd_regsnap(const char *cmd, const char *args)
+{
+    char name[MAX_CMDLEN];
+    if (get_token(&args, name, sizeof(name))) {
+        ScriptError("Expected <name>");
+        return;
+    }
+    if (!RegBlockCount) {
+        Output(C_ERROR "No register blocks defined for this machine");
+        return;
+    }
+    regSnap *rs = findSnap(name);
+    if (rs) {
+        freeSnap(rs);
+    } else {
+        for (int i=0; i<MAX_REGSNAPS; i++)
+            if (!RegSnaps[i].data) {
+                rs = &RegSnaps[i];
+                break;
+            }
+        if (!rs) {
+            Output(C_ERROR "Too many snapshots (use REGSNAP on an old name)");
+            return;
+        }
+    }
+    if (takeSnap(rs, name))
+        Output("Saved %d bytes of registers as '%s'"
+               , snapSize(rs->blockCount), rs->name);
+}
+REG_CMD(0, "REGSNAP", cmd_regsnap,
+        "REGSNAP <name>\n"
+        "  Save the contents of all register blocks (see REGBLOCKS) under\n"
+        "  <name> for a later REGDIFF.")
+
+static uint32
+getReg(const uint8 *p, uint32 width)
+{
+    switch (width) {
+    case 1: return *p;
+    case 2: return *(uint16*)p;
+    default: return *(uint32*)p;
+    }
+}
+
+// Show the changed registers of one block - adjacent changed
+// registers are reported together.
+static uint
+diffBlock(regBlock *rb, const uint8 *from, const uint8 *to, uint *runs)
+{
+    uint changed = 0;
+    int inRun = 0;
+    for (uint32 pos=0; pos<rb->size; pos+=rb->width) {
+        uint32 a = getReg(&from[pos], rb->width);
+        uint32 b = getReg(&to[pos], rb->width);
+        if (a == b) {
+            inRun = 0;
+            continue;
+        }
+        if (!inRun) {
+            uint32 end = pos;
+            while (end + rb->width < rb->size
+                   && getReg(&from[end + rb->width], rb->width)
+                   != getReg(&to[end + rb->width], rb->width))
+                end += rb->width;
+            Output("%s+%03x-%03x (%08x):", rb->name, pos, end
+                   , rb->paddr + pos);
+            (*runs)++;
+            inRun = 1;
+        }
+        Output("  %08x: %0*x -> %0*x (%0*x)", rb->paddr + pos
+               , rb->width*2, a, rb->width*2, b, rb->width*2, a ^ b);
+        changed++;
+    }
+    return changed;
+}
+
+static void
+cmd_regdiff(const char *cmd, const char *args)
+{
+    char name1[MAX_CMDLEN], name2[MAX_CMDLEN];
+    if (get_token(&args, name1, sizeof(name1))) {
+        ScriptError("Expected <name> [<name>]");
+        return;
+    }
+    regSnap *from = findSnap(name1);
+    if (!from) {
+        Output(C_ERROR "Unknown snapshot '%s'", name1);
+        return;
+    }
+    regSnap current, *to = &current;
+    if (get_token(&args, name2, sizeof(name2))) {
+        // Compare against the current register values.
+        if (!takeSnap(&current, "current"))
+            return;
+    } else {
+        to = findSnap(name2);
+        if (!to) {
+            Output(C_ERROR "Unknown snapshot '%s'", name2);
+            return;
+        }
+    }
+
+    uint blockCount = from->blockCount;
+    if (to->blockCount < blockCount)
+        blockCount = to->blockCount;
+    uint changed = 0, runs = 0;
+    const uint8 *a = from->data, *b = to->data;
+    for (uint i=0; i<blockCount; i++) {
+        regBlock *rb = &RegBlocks[i];
+        if ((from->failedBlocks | to->failedBlocks) & (1<<i))
+            Output(C_WARN "Skipping unreadable block %s", rb->name);
+        else
+            changed += diffBlock(rb, a, b, &runs);
+        a += rb->size;
+        b += rb->size;
+    }
+    Output("%d registers changed in %d runs (%s -> %s, %d ms apart)"
+           , changed, runs, from->name, to->name, to->time - from->time);
+
+    if (to == &current)
+        freeSnap(&current);
+}
+REG_CMD(0, "REGDIFF", cmd_regdiff,
+        "REGDIFF <name> [<name2>]\n"
+        "  Show the registers that differ between the snapshot <name> and\n"
+        "  snapshot <name2> (or the current values if <name2> is omitted).")
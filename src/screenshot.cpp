@@ -0,0 +1,374 @@
+/* Framebuffer capture.
+ *
+ * For conditions of use see file COPYING
+ */
+
+#include <windows.h> // GetTickCount
+#include <winsock.h> // socket
+#include <stdio.h> // FILE, fopen
+#include <stdlib.h> // malloc
+#include <string.h> // memcpy, memcmp
+
+#include "xtypes.h"
+#include "output.h" // Output, fnprepare
+#include "script.h" // REG_CMD
+#include "exceptions.h" // TRY_EXCEPTION_HANDLER
+#include "video.h" // vidGetVirtVRAM
+
+
+/****************************************************************
+ * Pixel conversion
+ ****************************************************************/
+
+// RGB565 to 0x00RRGGBB conversion tables indexed by the high and low
+// byte of a pixel.  Green straddles both bytes, but its 6 to 8 bit
+// expansion splits into disjoint bits, so the two lookups can just be
+// or'd together.
+static uint32 convHi[256], convLo[256];
+
+static void
+initConvTables()
+{
+    if (convHi[0xff])
+        return;
+    for (uint i=0; i<256; i++) {
+        uint r5 = i >> 3, gh = i & 0x07;
+        uint gl = i >> 5, b5 = i & 0x1f;
+        convHi[i] = (((r5 << 3) | (r5 >> 2)) << 16)
+            | (((gh << 5) | (gh >> 1)) << 8);
+        convLo[i] = ((gl << 2) << 8) | ((b5 << 3) | (b5 >> 2));
+    }
+}
+
+// Convert one row of RGB565 pixels to 24bit BGR (bmp order).
+static void
+convRow(uint8 *dest, const uint16 *src, uint count)
+{
+    while (count--) {
+        uint16 p = *src++;
+        uint32 c = convHi[p >> 8] | convLo[p & 0xff];
+        *dest++ = c;
+        *dest++ = c >> 8;
+        *dest++ = c >> 16;
+    }
+}
+
+
+/****************************************************************
+ * Output sinks
+ ****************************************************************/
+
+class shotSink {
+public:
+    uint32 total;
+    shotSink() : total(0) { }
+    virtual bool write(const void *data, uint32 len) = 0;
+};
+
+class fileSink : public shotSink {
+    FILE *f;
+public:
+    fileSink(FILE *fd) : f(fd) { }
+    bool write(const void *data, uint32 len) {
+        total += len;
+        return fwrite(data, len, 1, f) == 1;
+    }
+};
+
+class sockSink : public shotSink {
+    int sock;
+public:
+    sockSink(int s) : sock(s) { }
+    bool write(const void *data, uint32 len) {
+        const char *p = (const char *)data;
+        while (len) {
+            int ret = send(sock, p, len, 0);
+            if (ret <= 0)
+                return false;
+            p += ret;
+            len -= ret;
+            total += ret;
+        }
+        return true;
+    }
+};
+
+// Wait for a single connection on the given port.
+static int
+acceptOne(int port)
+{
+    int lsock = socket(AF_INET, SOCK_STREAM, 0);
+    if (lsock < 0) {
+        Output(C_ERROR "Failed to create socket");
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("0.0.0.0");
+    if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(lsock, 1) < 0) {
+        Output(C_ERROR "Failed to listen on port %d", port);
+        closesocket(lsock);
+        return -1;
+    }
+    Output("Waiting for connection on port %d", port);
+    int addrlen = sizeof(addr);
+    int sock = accept(lsock, (struct sockaddr *)&addr, &addrlen);
+    closesocket(lsock);
+    if (sock < 0)
+        Output(C_ERROR "Connection failed");
+    return sock;
+}
+
+
+/****************************************************************
+ * Frame capture
+ ****************************************************************/
+
+// Copy the visible framebuffer into a packed buffer (videoW*videoH
+// pixels).  Copying first keeps the frame consistent and keeps the
+// slow uncached video ram accesses to a single pass.
+static bool
+grabFrame(uint16 *vram, uint16 *dest)
+{
+    bool ok = true;
+    TRY_EXCEPTION_HANDLER {
+        uint8 *row = (uint8*)vram;
+        if (videoXStride == 2) {
+            for (uint y=0; y<videoH; y++, row += videoYStride, dest += videoW)
+                memcpy(dest, row, videoW * 2);
+        } else {
+            for (uint y=0; y<videoH; y++, row += videoYStride) {
+                uint8 *p = row;
+                for (uint x=0; x<videoW; x++, p += videoXStride)
+                    *dest++ = *(uint16*)p;
+            }
+        }
+    } CATCH_EXCEPTION_HANDLER {
+        Output(C_ERROR "Exception caught reading framebuffer");
+        ok = false;
+    }
+    return ok;
+}
+
+static inline void
+put16(uint8 *p, uint16 v)
+{
+    p[0] = v; p[1] = v >> 8;
+}
+
+static inline void
+put32(uint8 *p, uint32 v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+// Size of the intermediate buffer used to batch up writes.
+#define SHOT_BUFSIZE (64*1024)
+
+// Write a frame as a 24bit bmp file.
+static bool
+writeBMP(shotSink *sink, uint16 *frame, uint8 *buf)
+{
+    uint32 rowSize = (videoW * 3 + 3) & ~3;
+    uint32 imgSize = rowSize * videoH;
+    uint8 hdr[54];
+    memset(hdr, 0, sizeof(hdr));
+    hdr[0] = 'B'; hdr[1] = 'M';
+    put32(&hdr[2], sizeof(hdr) + imgSize);
+    put32(&hdr[10], sizeof(hdr));
+    put32(&hdr[14], 40);
+    put32(&hdr[18], videoW);
+    put32(&hdr[22], videoH);
+    put16(&hdr[26], 1);
+    put16(&hdr[28], 24);
+    put32(&hdr[34], imgSize);
+    if (!sink->write(hdr, sizeof(hdr)))
+        return false;
+
+    // Bmp rows are stored bottom up.
+    uint32 pos = 0;
+    memset(buf, 0, SHOT_BUFSIZE);
+    for (int y=videoH-1; y>=0; y--) {
+        if (pos + rowSize > SHOT_BUFSIZE) {
+            if (!sink->write(buf, pos))
+                return false;
+            pos = 0;
+        }
+        convRow(&buf[pos], &frame[y * videoW], videoW);
+        pos += rowSize;
+    }
+    return sink->write(buf, pos);
+}
+
+/*
+ * Repeated captures are written as a stream of row deltas so that a
+ * host can see exactly when (and where) the screen changed.  All
+ * values are little endian:
+ *
+ *   header: "HSHT" <u32 width> <u32 height>
+ *   frame:  <u32 msec since start> <u32 run count>
+ *           run count * (<u16 first row> <u16 rows> <raw rgb565 rows>)
+ *
+ * The first frame always contains every row.  See tools/shot2bmp.py.
+ */
+
+// Maximum number of changed row runs reported per frame.
+#define MAX_RUNS 64
+
+static bool
+writeDelta(shotSink *sink, uint32 msec, uint16 *frame, uint16 *prev
+           , uint *changedRows)
+{
+    uint32 rowBytes = videoW * 2;
+    uint16 runStart[MAX_RUNS], runLen[MAX_RUNS];
+    uint runCount = 0, rows = 0;
+    for (uint y=0; y<videoH; y++) {
+        if (prev && !memcmp(&frame[y*videoW], &prev[y*videoW], rowBytes))
+            continue;
+        rows++;
+        if (runCount && runStart[runCount-1] + runLen[runCount-1] == y) {
+            runLen[runCount-1]++;
+        } else if (runCount >= MAX_RUNS) {
+            // Too fragmented - just grow the last run.
+            runLen[runCount-1] = y - runStart[runCount-1] + 1;
+        } else {
+            runStart[runCount] = y;
+            runLen[runCount] = 1;
+            runCount++;
+        }
+    }
+    *changedRows = rows;
+
+    uint8 hdr[8];
+    put32(&hdr[0], msec);
+    put32(&hdr[4], runCount);
+    if (!sink->write(hdr, sizeof(hdr)))
+        return false;
+    for (uint i=0; i<runCount; i++) {
+        put16(&hdr[0], runStart[i]);
+        put16(&hdr[2], runLen[i]);
+        if (!sink->write(hdr, 4)
+            || !sink->write(&frame[runStart[i] * videoW]
+                            , runLen[i] * rowBytes))
+            return false;
+    }
+    return true;
+}
+
+static void
+captureFrames(shotSink *sink, uint16 *vram, uint frames, uint fps)
+{
+    uint32 frameSize = videoW * videoH * 2;
+    uint16 *cur = (uint16*)malloc(frameSize);
+    uint16 *prev = NULL;
+    uint8 *buf = NULL;
+    if (frames > 1)
+        prev = (uint16*)malloc(frameSize);
+    else
+        buf = (uint8*)malloc(SHOT_BUFSIZE);
+    if (!cur || (frames > 1 && !prev) || (frames == 1 && !buf)) {
+        Output(C_ERROR "Unable to allocate capture buffers");
+        goto out;
+    }
+
+    if (frames == 1) {
+        initConvTables();
+        if (grabFrame(vram, cur) && !writeBMP(sink, cur, buf))
+            Output(C_ERROR "Short write while saving screenshot");
+        goto out;
+    }
+
+    uint8 hdr[12];
+    memcpy(hdr, "HSHT", 4);
+    put32(&hdr[4], videoW);
+    put32(&hdr[8], videoH);
+    if (!sink->write(hdr, sizeof(hdr))) {
+        Output(C_ERROR "Short write while saving screenshot");
+        goto out;
+    }
+
+    uint32 interval, start_time, changedFrames;
+    interval = fps ? 1000 / fps : 0;
+    start_time = GetTickCount();
+    changedFrames = 0;
+    for (uint i=0; i<frames; i++) {
+        uint32 now = GetTickCount() - start_time;
+        if (i * interval > now) {
+            Sleep(i * interval - now);
+            now = GetTickCount() - start_time;
+        }
+        if (!grabFrame(vram, cur))
+            break;
+        uint changed;
+        if (!writeDelta(sink, now, cur, i ? prev : NULL, &changed)) {
+            Output(C_ERROR "Short write while saving screenshot");
+            break;
+        }
+        if (changed)
+            changedFrames++;
+        uint16 *t = prev; prev = cur; cur = t;
+    }
+    Output("Captured %d frames (%d with changes) in %d ms"
+           , frames, changedFrames, GetTickCount() - start_time);
+
+out:
+    free(cur);
+    free(prev);
+    free(buf);
+}
+
+static void
+cmd_screenshot(const char *cmd, const char *args)
+{
+    char rawfn[MAX_CMDLEN], fn[MAX_CMDLEN];
+    if (get_token(&args, rawfn, sizeof(rawfn))) {
+        ScriptError("file name expected");
+        return;
+    }
+    uint32 frames = 1, fps = 10;
+    get_expression(&args, &frames);
+    get_expression(&args, &fps);
+    if (!frames)
+        frames = 1;
+
+    uint16 *vram = vidGetVirtVRAM();
+    if (!vram)
+        return;
+    if (videoBPP != 16) {
+        Output(C_ERROR "Only 16bpp framebuffers are supported (have %d)"
+               , videoBPP);
+        return;
+    }
+
+    if (rawfn[0] == ':') {
+        int sock = acceptOne(atoi(&rawfn[1]));
+        if (sock < 0)
+            return;
+        sockSink sink(sock);
+        captureFrames(&sink, vram, frames, fps);
+        closesocket(sock);
+        Output("Sent %d bytes", sink.total);
+        return;
+    }
+
+    fnprepare(rawfn, fn, sizeof(fn));
+    FILE *f = fopen(fn, "wb");
+    if (!f) {
+        Output(C_ERROR "Cannot write file %s", fn);
+        return;
+    }
+    fileSink sink(f);
+    captureFrames(&sink, vram, frames, fps);
+    fclose(f);
+    Output("Wrote %d bytes to %s", sink.total, fn);
+}
+REG_CMD(0, "SCREENSHOT", cmd_screenshot,
+        "SCREENSHOT <file>|:<port> [<frames> [<fps>]]\n"
+        "  Save the screen contents as a 24bit bmp file.  If <file> is of\n"
+        "  the form :<port> then wait for a connection on <port> and send\n"
+        "  the data over it.  If <frames> is more than one, capture that\n"
+        "  many frames at <fps> (default 10) frames per second and write a\n"
+        "  stream of changed rows instead (see tools/shot2bmp.py).")
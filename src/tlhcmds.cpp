@@ -8,6 +8,8 @@
 
 #include <windows.h>
 #include <tlhelp32.h>
+#include <stdio.h> // _snprintf
+#include <stdlib.h> // qsort
 
 #include "memory.h" // IN_RANGE
 #include "xtypes.h" // uint
@@ -15,6 +17,7 @@
 #include "output.h" // Output
 #include "script.h" // REG_CMD
 #include "cpu.h" // MVAddr
+#include "tlhcmds.h"
 
 LATE_LOAD(CreateToolhelp32Snapshot, "toolhelp")
 LATE_LOAD(CloseToolhelp32Snapshot, "toolhelp")
@@ -171,67 +174,232 @@ REG_CMD(tlhAvail, "LSHEAP", heapDump,
         "  Dump heaps of a wince process.")
 #endif
 
+/****************************************************************
+ * Module index
+ ****************************************************************/
+
+// Toolhelp snapshots are slow, so a sorted list of all module address
+// ranges is built once and then searched with a binary search.  The
+// list is rebuilt on request (MODINDEX) or when a lookup in a process
+// slot fails and the list is older than MODINDEX_MAXAGE.
+#define MODINDEX_MAXAGE 10000
+
+struct modEntry {
+    uint32 base, size;
+    char name[32];
+    uint8 slot;
+};
+
+static struct modEntry *ModIndex;
+static int ModIndexCount, ModIndexAlloc;
+static uint32 ModIndexTime;
+static int ModIndexBuilt;
+// Process name for each 32Meg process slot.
+static char ProcNames[64][32];
+
+static const char *
+procForAddr(uint32 addr)
+{
+    if (addr >= 0x80000000)
+        return "";
+    return ProcNames[addr >> 25];
+}
+
+static int
+modAdd(uint32 base, uint32 size, const wchar_t *name, uint slot)
+{
+    if (ModIndexCount >= ModIndexAlloc) {
+        int newAlloc = ModIndexAlloc ? ModIndexAlloc * 2 : 256;
+        struct modEntry *n = (struct modEntry*)realloc(
+            ModIndex, newAlloc * sizeof(ModIndex[0]));
+        if (!n)
+            return -1;
+        ModIndex = n;
+        ModIndexAlloc = newAlloc;
+    }
+    struct modEntry *me = &ModIndex[ModIndexCount++];
+    me->base = base;
+    me->size = size;
+    me->slot = slot;
+    wcstombs(me->name, name, sizeof(me->name));
+    me->name[sizeof(me->name)-1] = 0;
+    return 0;
+}
+
+static int modComp(const void *e1, const void *e2) {
+    modEntry *m1 = (modEntry*)e1, *m2 = (modEntry*)e2;
+    return (m1->base < m2->base ? -1 : (m1->base > m2->base ? 1 : 0));
+}
+
+// Add the modules from a toolhelp module snapshot.
 static void
-cmd_addr2module(const char *cmd, const char *args)
+modAddSnapshot(HANDLE hTH, uint32 membase)
 {
-    uint32 addr;
-    if (!get_expression(&args, &addr)) {
-        ScriptError("virtual address expected");
-        return;
+    MODULEENTRY32 me;
+    me.dwSize = sizeof(me);
+    for (int ret=late_Module32First(hTH, &me); ret
+             ; ret=late_Module32Next(hTH, &me)) {
+        uint32 a = (uint32)me.modBaseAddr;
+        if (membase && a < 0x02000000)
+            a |= membase;
+        if (modAdd(a, me.modBaseSize, me.szModule, membase >> 25))
+            break;
     }
-    addr = MVAddr(addr);
+}
+
+// Rebuild the module index.
+void
+modIndexRefresh()
+{
+    ModIndexCount = 0;
+    ModIndexBuilt = 1;
+    ModIndexTime = GetTickCount();
+    memset(ProcNames, 0, sizeof(ProcNames));
+    if (!tlhAvail())
+        return;
 
     HANDLE hTH = late_CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
     if (hTH == INVALID_HANDLE_VALUE) {
         Output("Unable to create tool help snapshot");
         return;
     }
-
     PROCESSENTRY32 pe;
     pe.dwSize = sizeof(pe);
-    uint32 pid = 0;
-    uint32 membase = 0;
-
+    uint32 pids[64], bases[64];
+    int procCount = 0;
     for (int ret=late_Process32First(hTH, &pe); ret
              ; ret=late_Process32Next(hTH, &pe)) {
-        membase = pe.th32MemoryBase;
-        if (IN_RANGE(addr, membase, 0x02000000)) {
-            Output("Address %08x in process: %ls (%08x - %08x)"
-                   , addr, pe.szExeFile, membase, membase + 0x02000000);
-            pid = pe.th32ProcessID;
-            break;
+        uint32 slot = pe.th32MemoryBase >> 25;
+        wcstombs(ProcNames[slot], pe.szExeFile, sizeof(ProcNames[0]));
+        ProcNames[slot][sizeof(ProcNames[0])-1] = 0;
+        if (procCount < (int)ARRAY_SIZE(pids)) {
+            pids[procCount] = pe.th32ProcessID;
+            bases[procCount] = pe.th32MemoryBase;
+            procCount++;
         }
     }
-
     late_CloseToolhelp32Snapshot(hTH);
 
-    if (!pid) {
-        Output("Address %08x not process specific", addr);
-        hTH = late_CreateToolhelp32Snapshot(
-            TH32CS_SNAPMODULE|TH32CS_GETALLMODS, 0);
-    } else {
-        hTH = late_CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, pid);
+    // Per-process modules.
+    for (int i=0; i<procCount; i++) {
+        hTH = late_CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, pids[i]);
+        if (hTH == INVALID_HANDLE_VALUE)
+            continue;
+        modAddSnapshot(hTH, bases[i]);
+        late_CloseToolhelp32Snapshot(hTH);
     }
-    if (hTH == INVALID_HANDLE_VALUE) {
-        Output("Unable to create tool help snapshot");
-        return;
+    // Modules not tied to a process.
+    hTH = late_CreateToolhelp32Snapshot(TH32CS_SNAPMODULE|TH32CS_GETALLMODS
+                                        , 0);
+    if (hTH != INVALID_HANDLE_VALUE) {
+        modAddSnapshot(hTH, 0);
+        late_CloseToolhelp32Snapshot(hTH);
     }
 
-    MODULEENTRY32 me;
-    me.dwSize = sizeof(me);
-    for (int ret=late_Module32First(hTH, &me); ret
-             ; ret=late_Module32Next(hTH, &me)) {
-        uint32 a = (uint32)me.modBaseAddr;
-        if (pid && a < 0x02000000)
-            a |= membase;
-        if (IN_RANGE(addr, a, me.modBaseSize)) {
-            Output("  in module: %ls (%08x - %08x)", me.szModule
-                   , a, (uint32)(a + me.modBaseSize));
-            break;
-        }
+    // Sort and drop duplicates (shared dlls are reported by each
+    // process that uses them).
+    qsort(ModIndex, ModIndexCount, sizeof(ModIndex[0]), modComp);
+    int j = 0;
+    for (int i=0; i<ModIndexCount; i++) {
+        if (j && ModIndex[j-1].base == ModIndex[i].base
+            && ModIndex[j-1].size == ModIndex[i].size)
+            continue;
+        ModIndex[j++] = ModIndex[i];
     }
+    ModIndexCount = j;
+}
 
-    late_CloseToolhelp32Snapshot(hTH);
+static const struct modEntry *
+modSearch(uint32 addr)
+{
+    // Find the last entry with base <= addr.
+    int lo = 0, hi = ModIndexCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ModIndex[mid].base <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo && IN_RANGE(addr, ModIndex[lo-1].base, ModIndex[lo-1].size))
+        return &ModIndex[lo-1];
+    return NULL;
+}
+
+// Find the module containing a (modified virtual) address.  Returns
+// its name and sets 'offset', or returns NULL if not found.
+const char *
+modLookup(uint32 addr, uint32 *offset)
+{
+    if (!ModIndexBuilt)
+        modIndexRefresh();
+    const struct modEntry *me = modSearch(addr);
+    if (!me && procForAddr(addr)[0]
+        && GetTickCount() - ModIndexTime > MODINDEX_MAXAGE) {
+        // Index may be stale (eg, a dll was loaded) - rebuild it.
+        modIndexRefresh();
+        me = modSearch(addr);
+    }
+    if (!me)
+        return NULL;
+    *offset = addr - me->base;
+    return me->name;
+}
+
+static uint32 TraceModules;
+REG_VAR_INT(tlhAvail, "TRACEMODULES", TraceModules
+            , "Append module+offset to pc addresses in trace reports")
+
+// Fill 'buf' with " [module+offset]" for 'addr' if TRACEMODULES is
+// set (otherwise an empty string).
+void
+modAnnotate(char *buf, int len, uint32 addr)
+{
+    uint32 offset;
+    const char *name = NULL;
+    if (TraceModules)
+        name = modLookup(addr, &offset);
+    if (name)
+        _snprintf(buf, len, " [%s+%x]", name, offset);
+    else
+        buf[0] = 0;
+}
+
+static void
+cmd_modindex(const char *cmd, const char *args)
+{
+    modIndexRefresh();
+    Output("Indexed %d modules", ModIndexCount);
+}
+REG_CMD(tlhAvail, "MODINDEX", cmd_modindex,
+        "MODINDEX\n"
+        "  Rebuild the module address index used by ADDR2MOD and traces.")
+
+static void
+cmd_addr2module(const char *cmd, const char *args)
+{
+    uint32 addr;
+    if (!get_expression(&args, &addr)) {
+        ScriptError("virtual address expected");
+        return;
+    }
+    addr = MVAddr(addr);
+
+    if (!ModIndexBuilt)
+        modIndexRefresh();
+    const char *proc = procForAddr(addr);
+    if (proc[0])
+        Output("Address %08x in process: %s (%08x - %08x)"
+               , addr, proc, addr & 0xfe000000
+               , (addr & 0xfe000000) + 0x02000000);
+    else
+        Output("Address %08x not process specific", addr);
+
+    uint32 offset;
+    const char *name = modLookup(addr, &offset);
+    if (name)
+        Output("  in module: %s (%08x - %08x)", name, addr - offset
+               , addr - offset + modSearch(addr)->size);
 }
 REG_CMD(tlhAvail, "ADDR2MOD", cmd_addr2module,
         "ADDR2MOD <virtual address>\n"
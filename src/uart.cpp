@@ -1,51 +1,98 @@
 #include <windows.h>
 #include "pkfuncs.h" // VirtualCopy
+#include <string.h> // strlen, memcpy
+#include "xtypes.h"
+#include "output.h" // Output, outputfn, setGlobalOutputFn
+#include "script.h" // REG_CMD
+#include "arch-pxa.h" // testPXA
 #include "uart.h"
 
 #define FUART 0x40100000
 
+// PXA uart register offsets (in words) and bits
+#define UART_THR (0x00/4)
+#define UART_IER (0x04/4)
+#define UART_FCR (0x08/4)
+#define UART_LCR (0x0C/4)
+#define UART_LSR (0x14/4)
+#define FCR_TRFIFOE (1<<0)
+#define FCR_RESETRF (1<<1)
+#define FCR_RESETTF (1<<2)
+#define FCR_TIL (1<<3) // TDRQ only when the tx fifo is completely empty
+#define LSR_TDRQ (1<<5)
+#define IER_UUE (1<<6)
+
+// Depth of the pxa transmit fifo.
+#define UART_FIFOSIZE 64
+
+static volatile uint32 *pxa_base;
+
+// Map the uart registers - the mapping is kept for the life of haret.
+static volatile uint32 *UART_pxa_map()
+{
+  if (pxa_base)
+    return pxa_base;
+  void *base = VirtualAlloc(0, 0x1000, MEM_RESERVE, PAGE_READWRITE);
+  if (!base)
+    return NULL;
+  if (!VirtualCopy(base, (void *)(FUART/256), 0x1000
+                   , PAGE_READWRITE|PAGE_NOCACHE|PAGE_PHYSICAL)) {
+    VirtualFree(base, 0, MEM_RELEASE);
+    return NULL;
+  }
+  pxa_base = (volatile uint32 *)base;
+  return pxa_base;
+}
+
+// Push up to one fifo worth of data - returns the number of bytes
+// written (zero if the fifo hasn't drained yet).
+static int UART_pxa_write(const char *s, int len)
+{
+  volatile uint32 *base = UART_pxa_map();
+  if (!base || !(base[UART_LSR] & LSR_TDRQ))
+    return 0;
+  if (len > UART_FIFOSIZE)
+    len = UART_FIFOSIZE;
+  for (int i=0; i<len; i++)
+    base[UART_THR] = (uint8)s[i];
+  return len;
+}
+
 void UART_pxa_puts(char *s)
 {
-  UINT32 *base=(UINT32*)VirtualAlloc((void*)0x0,sizeof(void*)*0xffff, MEM_RESERVE,PAGE_READWRITE);
-  VirtualCopy(base,(void *) ((FUART)/256),sizeof(void*)*0xffff	, PAGE_READWRITE|PAGE_NOCACHE|PAGE_PHYSICAL);
-  int a=0;
-  while(s[a])
-  {
-    while(!(base[0x14/4]&1<<5)) {}
-    base[0]=(char)(s[a]);
-    a++;
+  int len = strlen(s);
+  while (len) {
+    int cnt = UART_pxa_write(s, len);
+    s += cnt;
+    len -= cnt;
   }
 }
 
 void UART_pxa_setup()
 {
-  UINT32 *base=(UINT32*)VirtualAlloc((void*)0x0,sizeof(void*)*0xffff, MEM_RESERVE,PAGE_READWRITE);
-  VirtualCopy(base,(void *) ((FUART)/256),sizeof(void*)*0xffff	, PAGE_READWRITE|PAGE_NOCACHE|PAGE_PHYSICAL);
+  volatile uint32 *base = UART_pxa_map();
+  if (!base)
+    return;
 
   // set DLAB
-  base[0x0C/4]=128+2+1;
+  base[UART_LCR]=128+2+1;
   // set divisor
   base[0]=8; // 115200 bps
-  base[0x04/4]=0;
+  base[UART_IER]=0;
   // unset DLAB
-  base[0x0C/4]=2+1;
-  // UART enable & no FIFO
-  base[0x04/4]=64;
-  base[0x08/4]=0;
+  base[UART_LCR]=2+1;
+  // UART enable & FIFO
+  base[UART_IER]=IER_UUE;
+  base[UART_FCR]=FCR_TRFIFOE|FCR_RESETRF|FCR_RESETTF|FCR_TIL;
 
   char test[]="LinExec: UART Initialized.\n\r";
-  int a=0;
-  while(test[a])
-  {
-    while(!(base[0x14/4]&1<<5)) {}
-    base[0]=(char)(test[a]);
-    a++;
-  }
+  UART_pxa_puts(test);
 }
 
 static struct uart_drv def_drv = {
 	UART_pxa_setup,
-	UART_pxa_puts
+	UART_pxa_puts,
+	UART_pxa_write
 };
 
 static struct uart_drv *uart_drv = &def_drv;
@@ -66,3 +113,151 @@ void UART_setDriver(struct uart_drv *drv)
 
 	(drv->setup)();
 }
+
+
+/****************************************************************
+ * Output() sink
+ ****************************************************************/
+
+// Size of the buffer between Output() and the uart.
+#define UART_RINGSIZE (16*1024)
+
+// Copies all output to the uart.  Messages are queued in a ring and
+// sent by a low priority thread so that callers never wait on the
+// serial line; if the ring fills the excess is dropped (and counted).
+class uartOutput : public outputfn {
+public:
+  CRITICAL_SECTION lock;
+  HANDLE event, thread;
+  volatile uint32 head, tail;
+  volatile int running;
+  uint32 dropped;
+  char ring[UART_RINGSIZE];
+
+  void sendMessage(const char *msg, int len);
+  void drain();
+};
+
+void
+uartOutput::sendMessage(const char *msg, int len)
+{
+  EnterCriticalSection(&lock);
+  uint32 space = UART_RINGSIZE - (head - tail);
+  if ((uint32)len > space) {
+    dropped += len - space;
+    len = space;
+  }
+  for (int i=0; i<len; i++)
+    ring[(head + i) % UART_RINGSIZE] = msg[i];
+  head += len;
+  LeaveCriticalSection(&lock);
+  SetEvent(event);
+}
+
+void
+uartOutput::drain()
+{
+  while (running) {
+    WaitForSingleObject(event, INFINITE);
+    for (;;) {
+      uint32 avail = head - tail;
+      if (!avail)
+        break;
+      uint32 pos = tail % UART_RINGSIZE;
+      uint32 cnt = UART_RINGSIZE - pos;
+      if (cnt > avail)
+        cnt = avail;
+      if (cnt > UART_FIFOSIZE)
+        cnt = UART_FIFOSIZE;
+      int sent;
+      if (uart_drv->write) {
+        sent = uart_drv->write(&ring[pos], cnt);
+      } else {
+        char buf[UART_FIFOSIZE + 1];
+        memcpy(buf, &ring[pos], cnt);
+        buf[cnt] = 0;
+        uart_drv->puts(buf);
+        sent = cnt;
+      }
+      if (!sent)
+        // Fifo still busy - a full fifo takes ~5ms at 115200.
+        Sleep(1);
+      tail += sent;
+    }
+  }
+}
+
+static DWORD WINAPI
+uartDrainThread(LPVOID arg)
+{
+  ((uartOutput*)arg)->drain();
+  return 0;
+}
+
+static uartOutput *UartOutput;
+
+static void
+cmd_uartlog(const char *cmd, const char *args)
+{
+  if (UartOutput) {
+    Output("Already logging to uart");
+    return;
+  }
+  UART_setup();
+
+  uartOutput *uo = new uartOutput;
+  if (!uo) {
+    Output(C_ERROR "Unable to allocate uart buffer");
+    return;
+  }
+  InitializeCriticalSection(&uo->lock);
+  uo->head = uo->tail = uo->dropped = 0;
+  uo->running = 1;
+  uo->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+  uo->thread = NULL;
+  if (uo->event)
+    uo->thread = CreateThread(NULL, 0, uartDrainThread, uo, 0, NULL);
+  if (!uo->thread) {
+    Output(C_ERROR "Unable to start uart thread");
+    if (uo->event)
+      CloseHandle(uo->event);
+    DeleteCriticalSection(&uo->lock);
+    delete uo;
+    return;
+  }
+  SetThreadPriority(uo->thread, THREAD_PRIORITY_BELOW_NORMAL);
+  UartOutput = uo;
+  setGlobalOutputFn(uo);
+}
+REG_CMD(testPXA, "UARTLOG", cmd_uartlog,
+        "UARTLOG\n"
+        "  Copy all output to the serial port (FFUART at 115200).")
+
+static void
+cmd_unuartlog(const char *cmd, const char *args)
+{
+  uartOutput *uo = UartOutput;
+  if (!uo)
+    return;
+  setGlobalOutputFn(NULL);
+  UartOutput = NULL;
+
+  // Let the thread flush what is queued.
+  uo->running = 0;
+  SetEvent(uo->event);
+  if (WaitForSingleObject(uo->thread, 5000) != WAIT_OBJECT_0) {
+    // The thread still uses the buffer - leak it rather than
+    // free it underneath the thread.
+    Output(C_WARN "Uart thread did not exit - not freeing its buffer");
+    return;
+  }
+  CloseHandle(uo->thread);
+  CloseHandle(uo->event);
+  DeleteCriticalSection(&uo->lock);
+  if (uo->dropped)
+    Output(C_WARN "Uart log dropped %d bytes", uo->dropped);
+  delete uo;
+}
+REG_CMD(testPXA, "UNUARTLOG", cmd_unuartlog,
+        "UNUARTLOG\n"
+        "  Stop copying output to the serial port.")
@@ -63,6 +63,11 @@ __LATE_LOAD(GXEndDraw, L"?GXEndDraw@@YAHXZ", L"gx", &returnZero)
 
 // Screen width and height
 uint videoW, videoH;
+// Bits per pixel and the byte distance between horizontally and
+// vertically adjacent pixels (either may be negative on rotated
+// displays).
+uint videoBPP;
+int videoXStride, videoYStride;
 
 // Return the virtual address of video RAM
 uint16 *vidGetVirtVRAM()
@@ -76,6 +81,9 @@ uint16 *vidGetVirtVRAM()
     if (ret > 0) {
         videoW = frameBufferInfo.cxPixels;
         videoH = frameBufferInfo.cyPixels;
+        videoBPP = frameBufferInfo.wBPP;
+        videoXStride = frameBufferInfo.cxStride;
+        videoYStride = frameBufferInfo.cyStride;
         return (uint16*)frameBufferInfo.pFramePointer;
     }
 
@@ -84,6 +92,9 @@ uint16 *vidGetVirtVRAM()
         uint16 *vaddr = (uint16 *)late_GXBeginDraw();
         videoW = GetSystemMetrics(SM_CXSCREEN);
         videoH = GetSystemMetrics(SM_CYSCREEN);
+        videoBPP = 16;
+        videoXStride = 2;
+        videoYStride = videoW * 2;
         late_GXEndDraw();
         late_GXCloseDisplay();
         return vaddr;
@@ -98,6 +109,9 @@ uint16 *vidGetVirtVRAM()
     if (ret > 0) {
         videoW = rfb.cxWidth;
         videoH = rfb.cyHeight;
+        videoBPP = rfb.cBPP;
+        videoXStride = rfb.cBPP / 8;
+        videoYStride = rfb.cbStride;
         return (uint16 *)rfb.pvFrameBuffer;
     }
 
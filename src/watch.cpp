@@ -16,6 +16,8 @@
 #include "script.h" // REG_CMD
 #include "irq.h" // __irq
 #include "memory.h" // memVirtToPhys
+#include "tlhcmds.h" // modAnnotate
+#include "regnames.h" // regAnnotate
 #include "watch.h"
 
 // Older versions of wince don't have SleepTillTick - use Sleep(1)
@@ -192,13 +194,18 @@ watchListVar::showVar(const char *args)
     memcheck *mc = watchlist;
     for (uint i=0; i<watchcount; i++, mc++) {
         char cmpBuf[32];
+        char capBuf[32] = "";
+        if (mc->captureCount)
+            _snprintf(capBuf, sizeof(capBuf), " capture %08x+%d"
+                      , mc->captureAddr, mc->captureCount);
         if (mc->isInsn)
-            Output("%2d: insn %08x %08x %s"
-                   , i, mc->insn, ~mc->mask, disp_suppress(mc, cmpBuf));
+            Output("%2d: insn %08x %08x %s%s"
+                   , i, mc->insn, ~mc->mask, disp_suppress(mc, cmpBuf)
+                   , capBuf);
         else
-            Output("%2d: 0x%08x %08x %2d %s"
+            Output("%2d: 0x%08x %08x %2d %s%s"
                    , i, mc->addr, ~mc->mask, 8<<mc->readSize
-                   , disp_suppress(mc, cmpBuf));
+                   , disp_suppress(mc, cmpBuf), capBuf);
     }
 }
 
@@ -211,14 +218,22 @@ watchListVar::beginWatch(int isStart)
     memcheck *mc = watchlist;
     for (uint i=0; i<watchcount; i++, mc++) {
         mc->trySuppress = 0;
+        watchpaddr[i] = (uint32)-1;
         if (mc->isInsn) {
             Output("Watching %s(%02d): Insn %08x"
                    , name, i, mc->insn);
         } else {
             uint32 paddr = memVirtToPhys(mc->addr);
+            watchpaddr[i] = paddr;
             Output("Watching %s(%02d): Addr %08x(@%08x)"
                    , name, i, mc->addr, paddr);
         }
+        capturepaddr[i] = (uint32)-1;
+        if (mc->captureCount) {
+            capturepaddr[i] = memVirtToPhys(mc->captureAddr);
+            Output("  capturing %d words at %08x(@%08x)"
+                   , mc->captureCount, mc->captureAddr, capturepaddr[i]);
+        }
     }
 }
 
@@ -231,16 +246,36 @@ watchListVar::reportWatch(const char *header, uint32 pos
     if (mc->isInsn)
         atype = "insn";
 
-    char pcbuf[32];
+    char pcbuf[80];
     const char *pcstr = "";
     if (pc) {
-        _snprintf(pcbuf, sizeof(pcbuf), " @~%08x", pc);
+        char modbuf[64];
+        modAnnotate(modbuf, sizeof(modbuf), pc);
+        _snprintf(pcbuf, sizeof(pcbuf), " @~%08x%s", pc, modbuf);
         pcstr = pcbuf;
     }
 
-    Output("%s %s %s(%d) %08x=%08x (%08x)%s"
+    char regbuf[140];
+    regAnnotate(regbuf, sizeof(regbuf), watchpaddr[pos], newval, changed);
+
+    Output("%s %s %s(%d) %08x=%08x (%08x)%s%s"
            , header, atype, name, pos
-           , mc->addr, newval, changed, pcstr);
+           , mc->addr, newval, changed, pcstr, regbuf);
+}
+
+// Report one word of the capture block of a triggered entry.
+void
+watchListVar::reportCapture(const char *header, uint32 pos
+                            , uint32 idx, uint32 val)
+{
+    memcheck *mc = &watchlist[pos];
+    uint32 paddr = capturepaddr[pos];
+    if (paddr != (uint32)-1)
+        paddr += idx * 4;
+    char regbuf[140];
+    regAnnotate(regbuf, sizeof(regbuf), paddr, val, 0);
+    Output("%s capture %s(%d) %08x=%08x%s"
+           , header, name, pos, mc->captureAddr + idx * 4, val, regbuf);
 }
 
 static watchListVar *
@@ -295,6 +330,53 @@ REG_CMD_ALT(0, "WBIT", ignoreBit, watch,
             "WBIT <watch list> <bit range> [<bit range>...]\n"
             "  Opposite of IBIT - remove bits from mask")
 
+// Attach a capture block to a watch list entry.
+static void
+cmd_wcapture(const char *cmd, const char *args)
+{
+    watchListVar *wl = FindWatchVar(&args);
+    if (!wl)
+        return;
+    uint32 pos, addr, count = 1;
+    if (!get_expression(&args, &pos)) {
+        ScriptError("Expected <index>");
+        return;
+    }
+    if (pos >= wl->watchcount) {
+        ScriptError("Index out of range (0..%d)", wl->watchcount - 1);
+        return;
+    }
+    memcheck *mc = &wl->watchlist[pos];
+    if (!get_expression(&args, &addr)) {
+        mc->captureCount = 0;
+        return;
+    }
+    get_expression(&args, &count);
+    if (addr & 3) {
+        ScriptError("Address %08x is not aligned for 32-bit accesses", addr);
+        return;
+    }
+    if (count < 1 || count > MAX_CAPTURE) {
+        ScriptError("Expected <count> of 1..%d", MAX_CAPTURE);
+        return;
+    }
+    // The reports find the physical address of each word from that
+    // of the first one.
+    if ((addr & (PAGE_SIZE-1)) + count * 4 > PAGE_SIZE) {
+        ScriptError("Capture block %08x-%08x crosses a page boundary"
+                    , addr, addr + count * 4 - 1);
+        return;
+    }
+    mc->captureAddr = addr;
+    mc->captureCount = count;
+}
+REG_CMD(0, "WCAPTURE", cmd_wcapture,
+        "WCAPTURE <watch list> <index> [<addr> [<count>]]\n"
+        "  Read and report <count> words at <addr> each time entry <index>\n"
+        "  of a watch list reports a change.  <addr> is a virtual address\n"
+        "  (can use P2V(physaddr)) and the block must not cross a page.\n"
+        "  Without <addr> the capture is removed.")
+
 
 /****************************************************************
  * Basic memory polling.
@@ -341,6 +423,9 @@ cmd_watch(const char *cmd, const char *args)
             char header[64];
             _snprintf(header, sizeof(header), "%06d:", cur_time - start_time);
             wl->reportWatch(header, i, val, changed);
+            for (uint j=0; j<mc->captureCount; j++)
+                wl->reportCapture(header, i, j
+                                  , ((volatile uint32*)mc->captureAddr)[j]);
         }
 
         cur_time = GetTickCount();
@@ -18,7 +18,8 @@
 #include "resource.h" // ID_PROGRESSBAR
 #include "script.h" // REG_CMD, setupCommands
 #include "haret.h" // hInst, MainWindow
-#include "cpu.h" // printWelcome
+#include "cpu.h" // printWelcome, lockAppPages
+#include "linboot.h" // unstageBoot
 #include "exceptions.h" // init_ehandling
 #include "output.h"
 
@@ -171,6 +172,22 @@ setOutputFn(outputfn *ofn)
     return old;
 }
 
+// Like the log file, the global output function sees all messages.
+// The lock ensures no thread is still inside the old function once
+// setGlobalOutputFn returns.
+static outputfn *globalOutputFn;
+static CRITICAL_SECTION globalOutputLock;
+
+outputfn *
+setGlobalOutputFn(outputfn *ofn)
+{
+    EnterCriticalSection(&globalOutputLock);
+    outputfn *old = globalOutputFn;
+    globalOutputFn = ofn;
+    LeaveCriticalSection(&globalOutputLock);
+    return old;
+}
+
 static int
 convertNL(char *outbuf, int maxlen, const char *inbuf, int len)
 {
@@ -222,6 +239,10 @@ Output(const char *format, ...)
     int len = convertNL(buf, sizeof(buf), rawbuf, rawlen);
 
     writeLog(buf, len);
+    EnterCriticalSection(&globalOutputLock);
+    if (globalOutputFn)
+        globalOutputFn->sendMessage(buf, len);
+    LeaveCriticalSection(&globalOutputLock);
     outputfn *ofn = getOutputFn();
     if (!ofn && code < 6) {
         Complain(rawbuf, rawlen, code-1);
@@ -286,6 +307,7 @@ void
 setupHaret()
 {
     preparePath();
+    InitializeCriticalSection(&globalOutputLock);
 
     // Open log file "haretlog.txt" if "earlyharetlog.txt" is found.
     char fn[100];
@@ -318,6 +340,9 @@ setupHaret()
     // Init memory maps.
     setupMemory();
 
+    // Keep the application resident for critical sections.
+    lockAppPages();
+
     // Setup variable/command lists.
     setupCommands();
 
@@ -334,6 +359,10 @@ void
 shutdownHaret()
 {
     Output("Shutting down");
+    // Don't leave wince resuming into freed memory.
+    unstageBoot();
+    freeContPool();
+    unlockAppPages();
     memPhysReset();
     closeLogFile();
 }
@@ -81,77 +81,6 @@ REG_CMD(NLSDAvail, "NLEDSET", LedSet,
         "  <id> is the LED id.\n"
         "  <value> may be 0 for off, 1 for on, or 2 for blink.")
 
-// The GetSystemPowerStatusEx2 is only available on wince 2.12 and
-// later.  However, earlier versions of CE have GetSystemPowerStatusEx
-// which uses a struct that is compatible (but smaller) than the
-// original.
-DWORD alt_GetSystemPowerStatusEx2(
-    PSYSTEM_POWER_STATUS_EX2 pSystemPowerStatusEx2, DWORD dwLen, BOOL fUpdate)
-{
-    bool ret = GetSystemPowerStatusEx(
-        (SYSTEM_POWER_STATUS_EX *)pSystemPowerStatusEx2, fUpdate);
-    if (ret)
-        return sizeof(SYSTEM_POWER_STATUS_EX);
-    return 0;
-}
-
-LATE_LOAD_ALT(GetSystemPowerStatusEx2, "coredll")
-
-static void
-powerMon(const char *cmd, const char *args)
-{
-    uint32 seconds;
-    if (!get_expression(&args, &seconds))
-        seconds = 0;
-
-    uint32 start_time = GetTickCount();
-    uint32 cur_time = start_time;
-    uint32 fin_time = cur_time + seconds * 1000;
-
-    for (;;) {
-        SYSTEM_POWER_STATUS_EX2 stat2;
-        memset(&stat2, 0, sizeof(stat2));
-        int ret = late_GetSystemPowerStatusEx2(&stat2, sizeof(stat2), false);
-        if (!ret) {
-            Output(C_INFO "GetSystemPowerStatusEx2");
-            return;
-        }
-
-        Output("%06d: %5d %5d %% %5ld %5ld %5ld %5ld "
-               "%5d %5d %5ld %5ld %5d %5d"
-               "  %5d %5d %5ld %5ld %5ld %5ld %5ld %5d",
-               cur_time - start_time,                  //
-               stat2.BatteryFlag,                      //
-               stat2.BatteryLifePercent,               //
-               stat2.BatteryVoltage,                   //  
-               stat2.BatteryCurrent,                   //  
-               stat2.BatteryAverageCurrent,            //  
-               stat2.BatteryTemperature,               //  
-               stat2.ACLineStatus,                     //  0x00
-               stat2.Reserved1,                        //  0x00
-               stat2.BatteryLifeTime,                  //  -1
-               stat2.BatteryFullLifeTime,              //  -1
-               stat2.Reserved2,                        //  0x00
-               stat2.BackupBatteryFlag,                //  0x01
-               stat2.BackupBatteryLifePercent,         //  255
-               stat2.Reserved3,                        //  0x00
-               stat2.BackupBatteryLifeTime,            //  -1
-               stat2.BackupBatteryFullLifeTime,        //  -1
-               stat2.BatteryAverageInterval,           //  0
-               stat2.BatterymAHourConsumed,            //  0
-               stat2.BackupBatteryVoltage,             //  0
-               stat2.BatteryChemistry);                 //  5
-
-        cur_time = GetTickCount();
-        if (cur_time >= fin_time)
-            break;
-        Sleep(1000);
-    }
-}
-REG_CMD(0, "POWERMON", powerMon,
-        "POWERMON [<seconds>]\n"
-        "  Watch power status")
-
 static void
 playSound(const char *cmd, const char *args)
 {
@@ -42,6 +42,8 @@ REG_VAR_INT(0, "RESUMEADDR", winceResumeAddr
             , "Location of wince resume handler")
 static uint32 *ResumePtr, OldResume[2];
 static struct stackJumper_s *ResumeSJ;
+// Block malloc'd for ResumeSJ (which may point into its middle).
+static void *ResumeMem;
 
 // Setup wince to resume into a haret handler.
 int
@@ -53,52 +55,58 @@ hookResume(uint32 handler, uint32 stack, uint32 data, int complain)
         Output(C_ERROR "Please specify WinCE physical resume address");
         return -1;
     }
+    if (ResumePtr) {
+        // Hooking again would lose the original vector (and free the
+        // trampoline the current hook uses).
+        Output(C_ERROR "Resume vector is already hooked"
+               " (run UNSTAGEBOOT first?)");
+        return -1;
+    }
 
     // Lookup wince resume address and verify it looks sane.
-    ResumePtr = (uint32*)memPhysMap(winceResumeAddr);
-    if (!ResumePtr) {
+    uint32 *ptr = (uint32*)memPhysMap(winceResumeAddr);
+    if (!ptr) {
         Output(C_ERROR "Could not map resume addr %08x", winceResumeAddr);
         return -1;
     }
     // Check for "b 0x41000 ; 0x0" at the address.
-    OldResume[0] = ResumePtr[0];
-    OldResume[1] = ResumePtr[1];
-    if (OldResume[0] != 0xea0003fe || OldResume[1] != 0x0) {
+    if (ptr[0] != 0xea0003fe || ptr[1] != 0x0) {
         Output(C_ERROR "Unexpected resume vector. (%08x %08x)"
-               , OldResume[0], OldResume[1]);
-        goto fail;
+               , ptr[0], ptr[1]);
+        return -1;
     }
 
     // Allocate and setup C code trampoline
-    ResumeSJ = (stackJumper_s*)malloc(sizeof(*ResumeSJ)*2);
-    if (! ResumeSJ) {
+    void *mem = malloc(sizeof(stackJumper_s)*2);
+    if (! mem) {
         Output("Unable to allocate memory for trampoline");
-        goto fail;
+        return -1;
     }
-    if (PAGE_ALIGN((uint32)ResumeSJ) != PAGE_ALIGN((uint32)&ResumeSJ[1]))
+    stackJumper_s *sj = (stackJumper_s*)mem;
+    if (PAGE_ALIGN((uint32)sj) != PAGE_ALIGN((uint32)&sj[1]))
         // Spans a page - move it to start of page.
-        ResumeSJ = (stackJumper_s*)PAGE_ALIGN((uint32)ResumeSJ);
-    memcpy(ResumeSJ, &stackJumper, sizeof(*ResumeSJ));
-    ResumeSJ->stack = stack;
-    ResumeSJ->data = data;
-    ResumeSJ->execCode = handler;
-    ResumeSJ->returnCode = winceResumeAddr + 0x1000;
-    handler = retryVirtToPhys((uint32)ResumeSJ->asm_handler);
+        sj = (stackJumper_s*)PAGE_ALIGN((uint32)sj);
+    memcpy(sj, &stackJumper, sizeof(*sj));
+    sj->stack = stack;
+    sj->data = data;
+    sj->execCode = handler;
+    sj->returnCode = winceResumeAddr + 0x1000;
+    handler = retryVirtToPhys((uint32)sj->asm_handler);
 
-    Output("Redirecting resume (%p) to %08x", ResumePtr, handler);
+    Output("Redirecting resume (%p) to %08x", ptr, handler);
 
     // Overwrite the resume vector.
+    ResumePtr = ptr;
+    ResumeMem = mem;
+    ResumeSJ = sj;
+    OldResume[0] = ptr[0];
+    OldResume[1] = ptr[1];
     take_control();
     Mach->flushCache();
     ResumePtr[0] = 0xe51ff004; // ldr pc, [pc, #-4]
     ResumePtr[1] = handler;
     return_control();
     return 0;
-fail:
-    free(ResumeSJ);
-    ResumeSJ = NULL;
-    ResumePtr = NULL;
-    return -1;
 }
 
 void
@@ -115,7 +123,8 @@ unhookResume()
     ResumePtr[1] = OldResume[1];
     return_control();
 
-    free(ResumeSJ);
+    free(ResumeMem);
+    ResumeMem = NULL;
     ResumeSJ = NULL;
     ResumePtr = NULL;
 }
@@ -0,0 +1,79 @@
+#!/usr/bin/env python
+# Build C tables of register names from the haretconsole register
+# definitions (haretconsole/regs_*.py).
+#
+# For conditions of use see file COPYING
+
+import sys
+import os
+
+def cstr(s):
+    return '"%s"' % s.replace('\\', '\\\\').replace('"', '\\"')
+
+def main():
+    if len(sys.argv) != 2:
+        sys.stderr.write("Usage: %s <haretconsole dir>\n" % sys.argv[0])
+        sys.exit(1)
+    sys.path.insert(0, sys.argv[1])
+    # Don't leave .pyc files in the haretconsole directory.
+    sys.dont_write_bytecode = True
+    import memalias
+    regslist = memalias.RegsList
+
+    sys.stdout.write("""// !!! This file is auto generated !!!
+// Please see tools/buildregs.py to regenerate this file.
+
+#include "regnames.h"
+
+""")
+
+    # Bit name tables are shared between registers with the same
+    # definitions (eg, regOneBits).
+    bitTables = {}
+    out = []
+    for bitdefs in [info[1] for regs in regslist.values()
+                    for info in regs.values()]:
+        if not bitdefs or bitdefs in bitTables:
+            continue
+        name = "Bits_%d" % len(bitTables)
+        bitTables[bitdefs] = name
+        out.append("static const struct regBitName %s[] = {" % name)
+        for mask, desc in bitdefs:
+            out.append("    { 0x%08x, %s }," % (mask & 0xffffffff, cstr(desc)))
+        out.append("};")
+
+    archs = regslist.keys()
+    archs.sort()
+    tables = []
+    for count, arch in enumerate(archs):
+        # Only memory mapped registers (not "insn:" coprocessor ones).
+        regs = dict([(addr, info) for addr, info in regslist[arch].items()
+                     if type(addr) != type("")])
+        name = "Regs_%d" % count
+        tables.append((arch, name, len(regs)))
+        out.append("")
+        out.append("// %s" % arch)
+        out.append("static const struct regName %s[] = {" % name)
+        # Sorted by address for the binary search in regLookup().
+        addrs = regs.keys()
+        addrs.sort()
+        for addr in addrs:
+            regname, bitdefs = regs[addr]
+            if bitdefs:
+                bits = "%s, %d" % (bitTables[bitdefs], len(bitdefs))
+            else:
+                bits = "0, 0"
+            out.append("    { 0x%08x, %s, %s }," % (
+                addr & 0xffffffff, cstr(regname), bits))
+        out.append("};")
+
+    out.append("")
+    out.append("const struct regTable RegTables[] = {")
+    for arch, name, count in tables:
+        out.append("    { %s, %s, %d }," % (cstr(arch), name, count))
+    out.append("};")
+    out.append("const int RegTableCount = %d;" % len(tables))
+    sys.stdout.write("\n".join(out) + "\n")
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,582 @@
+// Build or edit "newc" cpio archives (as used for linux initramfs).
+//
+// For conditions of use see file COPYING
+//
+// This is a host tool - see the "mkcpio" target in the Makefile.
+//
+// Usage: mkcpio [options] <source>...
+//   <source> is either a directory (its contents are added at the root
+//   of the archive) or <dest>=<path> (the file or directory <path> is
+//   added as <dest>).  Later sources override earlier ones.
+//
+//   -a <archive>  Start from the entries of an existing archive (which
+//                 may be gzip compressed)
+//   -r <name>     Remove <name> (and anything below it)
+//   -o <file>     Write the archive to <file> (default stdout)
+//   -c <type>     Compress the output with gzip, xz, or none (default)
+//   -j <count>    Number of threads to read and compress with
+//   -t <mtime>    Timestamp stored for all entries (default
+//                 $SOURCE_DATE_EPOCH or 0)
+//   -P            Keep the owner of files instead of using root
+//
+// The output only depends on the contents of the inputs: entries are
+// sorted by name, inode numbers are assigned sequentially, and times
+// and (by default) owners are fixed.
+
+#include <stdio.h> // fprintf
+#include <stdlib.h> // strtoul
+#include <string.h> // strcmp
+#include <errno.h> // errno
+#include <unistd.h> // getopt, readlink
+#include <fcntl.h> // open
+#include <dirent.h> // opendir
+#include <sys/stat.h> // lstat
+#include <sys/sysmacros.h> // major, minor
+#include <zlib.h> // deflate, gzopen
+#ifdef HAVE_LZMA
+#include <lzma.h> // lzma_stream_encoder_mt
+#endif
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+typedef unsigned int uint32;
+
+static void
+fatal(const char *msg, const std::string &arg)
+{
+    fprintf(stderr, "mkcpio: %s %s: %s\n", msg, arg.c_str(), strerror(errno));
+    exit(1);
+}
+
+
+/****************************************************************
+ * Archive entries
+ ****************************************************************/
+
+struct cpioEntry {
+    uint32 mode, uid, gid, mtime, size;
+    uint32 rdevMajor, rdevMinor;
+    // Where the data comes from - either a file on disk or the
+    // contents held in memory (symlink targets, base archive data).
+    std::string path;
+    std::string data;
+    bool inMemory;
+};
+
+typedef std::map<std::string, cpioEntry> entryMap;
+
+static uint32 FixedTime;
+static int KeepOwner;
+
+// Strip leading "./" and "/" so names are relative to the root.
+static std::string
+cleanName(std::string name)
+{
+    for (;;) {
+        if (name.compare(0, 2, "./") == 0)
+            name.erase(0, 2);
+        else if (name.compare(0, 1, "/") == 0)
+            name.erase(0, 1);
+        else
+            break;
+    }
+    while (name.size() > 1 && name[name.size()-1] == '/')
+        name.erase(name.size()-1);
+    return name;
+}
+
+static void
+addPath(entryMap &entries, const std::string &name, const std::string &path)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st))
+        fatal("Unable to stat", path);
+
+    cpioEntry e;
+    e.mode = st.st_mode;
+    e.uid = KeepOwner ? st.st_uid : 0;
+    e.gid = KeepOwner ? st.st_gid : 0;
+    e.mtime = FixedTime;
+    e.size = 0;
+    e.rdevMajor = e.rdevMinor = 0;
+    e.inMemory = true;
+    if (S_ISREG(st.st_mode)) {
+        e.size = st.st_size;
+        e.path = path;
+        e.inMemory = false;
+    } else if (S_ISLNK(st.st_mode)) {
+        char buf[4096];
+        int len = readlink(path.c_str(), buf, sizeof(buf));
+        if (len < 0)
+            fatal("Unable to read link", path);
+        e.data.assign(buf, len);
+        e.size = len;
+    } else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
+        e.rdevMajor = major(st.st_rdev);
+        e.rdevMinor = minor(st.st_rdev);
+    }
+    if (!name.empty())
+        entries[name] = e;
+
+    if (!S_ISDIR(st.st_mode))
+        return;
+    DIR *d = opendir(path.c_str());
+    if (!d)
+        fatal("Unable to open directory", path);
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        std::string child = name.empty() ? de->d_name : name + "/" + de->d_name;
+        addPath(entries, child, path + "/" + de->d_name);
+    }
+    closedir(d);
+}
+
+static void
+removeTree(entryMap &entries, const std::string &name)
+{
+    entries.erase(name);
+    std::string prefix = name + "/";
+    entryMap::iterator it = entries.lower_bound(prefix);
+    while (it != entries.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+        entries.erase(it++);
+}
+
+static uint32
+hexField(const char *p)
+{
+    char buf[9];
+    memcpy(buf, p, 8);
+    buf[8] = 0;
+    return strtoul(buf, NULL, 16);
+}
+
+static void
+gzreadAll(gzFile f, char *buf, uint32 len, const std::string &fn)
+{
+    while (len) {
+        int ret = gzread(f, buf, len);
+        if (ret <= 0) {
+            errno = EINVAL;
+            fatal("Truncated archive", fn);
+        }
+        buf += ret;
+        len -= ret;
+    }
+}
+
+static void
+gzskipPad(gzFile f, uint32 pos)
+{
+    char pad[4];
+    if (pos & 3)
+        gzread(f, pad, 4 - (pos & 3));
+}
+
+// Load the entries of an existing (plain or gzip) newc archive.
+static void
+readArchive(entryMap &entries, const std::string &fn)
+{
+    gzFile f = gzopen(fn.c_str(), "rb");
+    if (!f)
+        fatal("Unable to open", fn);
+    uint32 pos = 0;
+    for (;;) {
+        char hdr[110];
+        gzreadAll(f, hdr, sizeof(hdr), fn);
+        if (memcmp(hdr, "070701", 6) && memcmp(hdr, "070702", 6)) {
+            errno = EINVAL;
+            fatal("Not a newc cpio archive", fn);
+        }
+        uint32 namesize = hexField(&hdr[94]);
+        std::vector<char> name(namesize + 1);
+        gzreadAll(f, &name[0], namesize, fn);
+        pos += sizeof(hdr) + namesize;
+        gzskipPad(f, pos);
+        pos = (pos + 3) & ~3;
+        std::string n = cleanName(&name[0]);
+        if (n == "TRAILER!!!")
+            break;
+
+        cpioEntry e;
+        e.mode = hexField(&hdr[14]);
+        e.uid = hexField(&hdr[22]);
+        e.gid = hexField(&hdr[30]);
+        e.mtime = hexField(&hdr[46]);
+        e.size = hexField(&hdr[54]);
+        e.rdevMajor = hexField(&hdr[78]);
+        e.rdevMinor = hexField(&hdr[86]);
+        e.inMemory = true;
+        e.data.resize(e.size);
+        if (e.size)
+            gzreadAll(f, &e.data[0], e.size, fn);
+        pos += e.size;
+        gzskipPad(f, pos);
+        pos = (pos + 3) & ~3;
+        if (!n.empty() && n != ".")
+            entries[n] = e;
+    }
+    gzclose(f);
+}
+
+
+/****************************************************************
+ * Output sinks
+ ****************************************************************/
+
+class outSink {
+public:
+    virtual ~outSink() { }
+    virtual void write(const char *data, size_t len) = 0;
+    virtual void finish() { }
+};
+
+static void
+writeAll(int fd, const char *data, size_t len)
+{
+    while (len) {
+        ssize_t ret = ::write(fd, data, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            fatal("Write failed", "");
+        }
+        data += ret;
+        len -= ret;
+    }
+}
+
+class fdSink : public outSink {
+    int fd;
+public:
+    fdSink(int f) : fd(f) { }
+    void write(const char *data, size_t len) { writeAll(fd, data, len); }
+};
+
+// Compress on a separate thread - the archive writer hands over
+// blocks through a small bounded queue.
+class threadedSink : public outSink {
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<std::string> queue;
+    std::string cur;
+    bool done;
+    std::thread worker;
+    void run() {
+        for (;;) {
+            std::string block;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                cond.wait(l, [this]{ return !queue.empty() || done; });
+                if (queue.empty())
+                    break;
+                block.swap(queue.front());
+                queue.pop_front();
+            }
+            cond.notify_all();
+            compress(block.data(), block.size(), false);
+        }
+        compress(NULL, 0, true);
+    }
+protected:
+    enum { BLOCKSIZE = 1024*1024, MAXQUEUE = 8 };
+    int fd;
+    virtual void compress(const char *data, size_t len, bool last) = 0;
+    void start() { worker = std::thread(&threadedSink::run, this); }
+public:
+    threadedSink(int f) : done(false), fd(f) { }
+    void write(const char *data, size_t len) {
+        cur.append(data, len);
+        if (cur.size() < BLOCKSIZE)
+            return;
+        std::unique_lock<std::mutex> l(lock);
+        cond.wait(l, [this]{ return queue.size() < MAXQUEUE; });
+        queue.push_back(std::string());
+        queue.back().swap(cur);
+        cond.notify_all();
+    }
+    void finish() {
+        {
+            std::unique_lock<std::mutex> l(lock);
+            if (!cur.empty())
+                queue.push_back(cur);
+            done = true;
+        }
+        cond.notify_all();
+        worker.join();
+    }
+};
+
+class gzipSink : public threadedSink {
+    z_stream zs;
+    void compress(const char *data, size_t len, bool last) {
+        char buf[64*1024];
+        zs.next_in = (Bytef*)data;
+        zs.avail_in = len;
+        int ret;
+        do {
+            zs.next_out = (Bytef*)buf;
+            zs.avail_out = sizeof(buf);
+            ret = deflate(&zs, last ? Z_FINISH : Z_NO_FLUSH);
+            writeAll(fd, buf, sizeof(buf) - zs.avail_out);
+        } while (zs.avail_out == 0 || (last && ret != Z_STREAM_END));
+    }
+public:
+    gzipSink(int f) : threadedSink(f) {
+        memset(&zs, 0, sizeof(zs));
+        // windowBits+16 writes a gzip header (with a zero timestamp).
+        if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY)
+            != Z_OK)
+            fatal("Unable to initialize", "zlib");
+        start();
+    }
+    ~gzipSink() { deflateEnd(&zs); }
+};
+
+#ifdef HAVE_LZMA
+class xzSink : public threadedSink {
+    lzma_stream ls;
+    void compress(const char *data, size_t len, bool last) {
+        uint8_t buf[64*1024];
+        ls.next_in = (const uint8_t*)data;
+        ls.avail_in = len;
+        lzma_ret ret;
+        do {
+            ls.next_out = buf;
+            ls.avail_out = sizeof(buf);
+            ret = lzma_code(&ls, last ? LZMA_FINISH : LZMA_RUN);
+            writeAll(fd, (char*)buf, sizeof(buf) - ls.avail_out);
+        } while (ls.avail_out == 0 || (last && ret != LZMA_STREAM_END));
+    }
+public:
+    xzSink(int f, int threads) : threadedSink(f) {
+        ls = LZMA_STREAM_INIT;
+        lzma_mt mt;
+        memset(&mt, 0, sizeof(mt));
+        mt.threads = threads;
+        mt.preset = 6;
+        // The kernel's xz decoder only supports crc32.
+        mt.check = LZMA_CHECK_CRC32;
+        if (lzma_stream_encoder_mt(&ls, &mt) != LZMA_OK)
+            fatal("Unable to initialize", "liblzma");
+        start();
+    }
+    ~xzSink() { lzma_end(&ls); }
+};
+#endif
+
+
+/****************************************************************
+ * Archive writing
+ ****************************************************************/
+
+class cpioWriter {
+    outSink *out;
+    uint32 pos;
+public:
+    cpioWriter(outSink *o) : out(o), pos(0) { }
+    void put(const char *data, size_t len) {
+        out->write(data, len);
+        pos += len;
+    }
+    void pad() {
+        static const char zeros[4] = { 0 };
+        if (pos & 3)
+            put(zeros, 4 - (pos & 3));
+    }
+    void header(const std::string &name, const cpioEntry &e, uint32 ino) {
+        char hdr[111];
+        snprintf(hdr, sizeof(hdr)
+                 , "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X"
+                 , ino, e.mode, e.uid, e.gid, S_ISDIR(e.mode) ? 2 : 1
+                 , e.mtime, e.size, 0, 0, e.rdevMajor, e.rdevMinor
+                 , (uint32)name.size() + 1, 0);
+        put(hdr, 110);
+        put(name.c_str(), name.size() + 1);
+        pad();
+    }
+};
+
+// Files are read by worker threads while the archive is written in
+// order; 'Window' bounds how far ahead of the writer they may get.
+struct readQueue {
+    std::vector<const cpioEntry *> files;
+    std::vector<std::string> data;
+    std::vector<bool> ready;
+    size_t next, written, window;
+    std::mutex lock;
+    std::condition_variable cond;
+};
+
+static void
+readWorker(readQueue *rq)
+{
+    for (;;) {
+        size_t idx;
+        {
+            std::unique_lock<std::mutex> l(rq->lock);
+            rq->cond.wait(l, [rq]{
+                    return rq->next >= rq->files.size()
+                        || rq->next < rq->written + rq->window; });
+            if (rq->next >= rq->files.size())
+                return;
+            idx = rq->next++;
+        }
+        const cpioEntry *e = rq->files[idx];
+        std::string buf(e->size, 0);
+        int fd = open(e->path.c_str(), O_RDONLY);
+        if (fd < 0)
+            fatal("Unable to open", e->path);
+        size_t got = 0;
+        while (got < buf.size()) {
+            ssize_t ret = read(fd, &buf[got], buf.size() - got);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0) {
+                errno = EIO;
+                fatal("File changed while reading", e->path);
+            }
+            got += ret;
+        }
+        close(fd);
+        {
+            std::unique_lock<std::mutex> l(rq->lock);
+            rq->data[idx].swap(buf);
+            rq->ready[idx] = true;
+        }
+        rq->cond.notify_all();
+    }
+}
+
+static void
+writeArchive(entryMap &entries, outSink *out, int threads)
+{
+    readQueue rq;
+    for (entryMap::iterator it = entries.begin(); it != entries.end(); ++it)
+        if (!it->second.inMemory)
+            rq.files.push_back(&it->second);
+    rq.data.resize(rq.files.size());
+    rq.ready.resize(rq.files.size());
+    rq.next = rq.written = 0;
+    rq.window = threads * 4;
+    std::vector<std::thread> workers;
+    for (int i=0; i<threads; i++)
+        workers.push_back(std::thread(readWorker, &rq));
+
+    cpioWriter w(out);
+    uint32 ino = 721;
+    for (entryMap::iterator it = entries.begin(); it != entries.end(); ++it) {
+        const cpioEntry &e = it->second;
+        w.header(it->first, e, ino++);
+        if (e.inMemory) {
+            w.put(e.data.data(), e.data.size());
+        } else {
+            std::string buf;
+            {
+                std::unique_lock<std::mutex> l(rq.lock);
+                rq.cond.wait(l, [&rq]{ return (bool)rq.ready[rq.written]; });
+                buf.swap(rq.data[rq.written]);
+                rq.written++;
+            }
+            rq.cond.notify_all();
+            w.put(buf.data(), buf.size());
+        }
+        w.pad();
+    }
+    cpioEntry trailer;
+    trailer.mode = trailer.uid = trailer.gid = trailer.mtime = trailer.size = 0;
+    trailer.rdevMajor = trailer.rdevMinor = 0;
+    w.header("TRAILER!!!", trailer, 0);
+
+    for (size_t i=0; i<workers.size(); i++)
+        workers[i].join();
+}
+
+
+/****************************************************************
+ * Main
+ ****************************************************************/
+
+static void
+usage()
+{
+    fprintf(stderr, "Usage: mkcpio [-a archive] [-r name] [-o file]"
+            " [-c gzip|xz|none] [-j threads] [-t mtime] [-P] <source>...\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *outName = NULL, *compress = "none";
+    int threads = std::thread::hardware_concurrency();
+    std::vector<std::string> archives, removes;
+    const char *sde = getenv("SOURCE_DATE_EPOCH");
+    if (sde)
+        FixedTime = strtoul(sde, NULL, 10);
+    int c;
+    while ((c = getopt(argc, argv, "a:r:o:c:j:t:P")) != -1) {
+        switch (c) {
+        case 'a': archives.push_back(optarg); break;
+        case 'r': removes.push_back(cleanName(optarg)); break;
+        case 'o': outName = optarg; break;
+        case 'c': compress = optarg; break;
+        case 'j': threads = atoi(optarg); break;
+        case 't': FixedTime = strtoul(optarg, NULL, 0); break;
+        case 'P': KeepOwner = 1; break;
+        default: usage();
+        }
+    }
+    if (threads < 1)
+        threads = 1;
+    if (optind >= argc && archives.empty())
+        usage();
+
+    entryMap entries;
+    for (size_t i=0; i<archives.size(); i++)
+        readArchive(entries, archives[i]);
+    for (int i=optind; i<argc; i++) {
+        std::string src = argv[i];
+        size_t eq = src.find('=');
+        if (eq == std::string::npos)
+            addPath(entries, "", src);
+        else
+            addPath(entries, cleanName(src.substr(0, eq)), src.substr(eq + 1));
+    }
+    for (size_t i=0; i<removes.size(); i++)
+        removeTree(entries, removes[i]);
+
+    int fd = 1;
+    if (outName) {
+        fd = open(outName, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd < 0)
+            fatal("Unable to create", outName);
+    }
+    outSink *out;
+    if (!strcmp(compress, "gzip"))
+        out = new gzipSink(fd);
+#ifdef HAVE_LZMA
+    else if (!strcmp(compress, "xz"))
+        out = new xzSink(fd, threads);
+#endif
+    else if (!strcmp(compress, "none"))
+        out = new fdSink(fd);
+    else {
+        fprintf(stderr, "mkcpio: unsupported compression '%s'\n", compress);
+        return 1;
+    }
+
+    writeArchive(entries, out, threads);
+    out->finish();
+    delete out;
+    if (outName && close(fd))
+        fatal("Unable to write", outName);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#!/usr/bin/env python
+
+# Tool to convert the frame stream written by "screenshot <file> <frames>"
+# into a series of bmp files (<prefix>-NNNN.bmp).
+
+import sys
+import struct
+
+def printUsage():
+    print "Usage:\n   %s <stream> <prefix>" % (sys.argv[0],)
+    sys.exit(1)
+
+def conv565(data):
+    out = []
+    for i in range(0, len(data), 2):
+        p = struct.unpack("<H", data[i:i+2])[0]
+        r = (p >> 11) & 0x1f
+        g = (p >> 5) & 0x3f
+        b = p & 0x1f
+        out.append(chr((b << 3) | (b >> 2)) + chr((g << 2) | (g >> 4))
+                   + chr((r << 3) | (r >> 2)))
+    return "".join(out)
+
+def writeBMP(filename, width, height, rows):
+    rowsize = (width * 3 + 3) & ~3
+    pad = "\0" * (rowsize - width * 3)
+    f = open(filename, "wb")
+    f.write("BM" + struct.pack("<IHHI", 54 + rowsize * height, 0, 0, 54))
+    f.write(struct.pack("<IiiHHIIiiII", 40, width, height, 1, 24, 0
+                        , rowsize * height, 0, 0, 0, 0))
+    for y in range(height-1, -1, -1):
+        f.write(conv565(rows[y]) + pad)
+    f.close()
+
+def main():
+    if len(sys.argv) != 3:
+        printUsage()
+    data = open(sys.argv[1], "rb").read()
+    prefix = sys.argv[2]
+
+    if data[:4] != "HSHT":
+        print "Not a valid screenshot stream"
+        sys.exit(1)
+    width, height = struct.unpack("<II", data[4:12])
+    rowbytes = width * 2
+    rows = ["\0" * rowbytes] * height
+    pos = 12
+    frame = 0
+    while pos + 8 <= len(data):
+        msec, runs = struct.unpack("<II", data[pos:pos+8])
+        pos += 8
+        changed = 0
+        for i in range(runs):
+            start, count = struct.unpack("<HH", data[pos:pos+4])
+            pos += 4
+            for y in range(start, start + count):
+                rows[y] = data[pos:pos+rowbytes]
+                pos += rowbytes
+            changed += count
+        print "frame %d: %dms %d rows changed" % (frame, msec, changed)
+        if changed or not frame:
+            writeBMP("%s-%04d.bmp" % (prefix, frame), width, height, rows)
+        frame += 1
+
+if __name__ == '__main__':
+    main()